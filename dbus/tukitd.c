@@ -1,172 +1,511 @@
 ﻿/* SPDX-License-Identifier: GPL-2.0-or-later */
 /* SPDX-FileCopyrightText: Copyright SUSE LLC */
 
+#define _GNU_SOURCE
 #include "Bindings/libtukit.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <systemd/sd-bus.h>
 #include <systemd/sd-event.h>
+#include <sys/eventfd.h>
+#include <time.h>
 #include <unistd.h>
 #include <wordexp.h>
 
 #define _cleanup_(f) __attribute__((cleanup(f)))
 
 enum transactionstates { queued, running, finished };
+static const char* transactionstate_names[] = { "queued", "running", "finished" };
+
+// Number of hash buckets of the transaction registry; the number of snapshots being
+// processed at the same time is small, so the table doesn't need to grow.
+#define REGISTRY_BUCKETS 64
 
 typedef struct t_entry {
     char* id;
+    char* owner;
+    uint64_t started;
+    _Atomic enum transactionstates state;
+    atomic_uint progress;
+    // Number of Calls sharing this entry; only modified from the main event loop
+    unsigned int users;
+    int shared;
+    // Number of those Calls currently running; the entry is finished when none is left
+    atomic_uint active;
+    // Resumed transaction shared by all running Calls and the mount namespace of its bind
+    // mounts, guarded by txlock
+    pthread_mutex_t txlock;
+    struct tukit_tx* tx;
+    int nsfd;
+    unsigned int txusers;
     struct t_entry *next;
-    enum transactionstates state;
 } TransactionEntry;
 
+// Results of worker threads waiting to be signalled by the main event loop
+typedef struct t_result {
+    char* id;
+    const char* signal;
+    int returncode;
+    char* output;
+    size_t len;
+    // Final result of the request, releasing its lock of the snapshot
+    int unlock;
+    struct t_result *next;
+} TransactionResult;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int fd;
+    TransactionResult* head;
+    TransactionResult** tail;
+} ResultQueue;
+
+// A "warm" snapshot of the current default snapshot, created and mounted in advance, so
+// Open and Execute for "default" can use it immediately (see spare_claim).
+enum sparestates { spare_disabled, spare_empty, spare_filling, spare_ready };
+
+typedef struct {
+    pthread_mutex_t lock;
+    enum sparestates state;
+    // The default snapshot changed while the spare was being created
+    int stale;
+    struct tukit_tx* tx;
+    char* base;
+    // Mount namespace the spare's bind mounts were created in
+    int nsfd;
+} SpareSnapshot;
+
+typedef struct {
+    TransactionEntry* buckets[REGISTRY_BUCKETS];
+    size_t size;
+    sd_bus* bus;
+    ResultQueue results;
+    SpareSnapshot spare;
+} TransactionRegistry;
+
 struct call_args {
     char *transaction;
     char *command;
     int chrooted;
-    enum transactionstates *state;
+    int stream;
+    TransactionEntry *entry;
+    ResultQueue *results;
 };
 struct execute_args {
     struct tukit_tx *transaction;
+    // Snapshot ID, owned by the worker thread
+    char *snapid;
     char *command;
-    enum transactionstates *state;
+    TransactionEntry *entry;
+    ResultQueue *results;
+    SpareSnapshot *spare;
+    // Mount namespace of a claimed spare snapshot or -1, owned by the worker thread
+    int nsfd;
     char *rebootmethod;
+    int stream;
 };
+struct output_stream {
+    ResultQueue *results;
+    const char *transaction;
+};
+
+static size_t registry_hash(const char* id) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *id != '\0'; id++) {
+        hash ^= (unsigned char)*id;
+        hash *= 16777619u;
+    }
+    return hash % REGISTRY_BUCKETS;
+}
+
+static TransactionEntry* registry_find(TransactionRegistry* registry, const char* transaction) {
+    TransactionEntry* entry = registry->buckets[registry_hash(transaction)];
+    while (entry != NULL && strcmp(entry->id, transaction) != 0) {
+        entry = entry->next;
+    }
+    return entry;
+}
 
-// Even though userdata / activeTransaction is shared between several threads, due to
+static void registry_free_entry(TransactionEntry* entry) {
+    if (entry->nsfd >= 0) {
+        close(entry->nsfd);
+    }
+    pthread_mutex_destroy(&entry->txlock);
+    free(entry->id);
+    free(entry->owner);
+    free(entry);
+}
+
+static uint64_t now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Even though userdata / the registry is shared between several threads, due to
 // systemd's serial event loop processing it's always guaranteed that no parallel
 // access will be happen: lockSnapshot will be called in the event functions before
-// starting the new thread, and unlockSnapshot is triggered by the signal when a
-// thread has finished.
-// Any method which does write the variable must do so from the main event loop.
-int lockSnapshot(void* userdata, const char* transaction, sd_bus_error *ret_error) {
+// starting the new thread, and unlockSnapshot is triggered by result_handler when a
+// thread has posted its final result (exactly one per request). Worker
+// threads only ever touch the atomic state, active and progress fields and the shared
+// transaction (see acquire_tx) of their own entry.
+// Any method which does write the registry must do so from the main event loop.
+// Several Calls may lock the same snapshot at the same time if all of them request a
+// shared lock; every other operation requires exclusive access.
+int lockSnapshot(void* userdata, sd_bus_message *m, const char* transaction, int shared, TransactionEntry** ret_entry, sd_bus_error *ret_error) {
     fprintf(stdout, "Locking further invocations for snapshot %s...\n", transaction);
-    TransactionEntry* activeTransaction = userdata;
+    TransactionRegistry* registry = userdata;
     TransactionEntry* newTransaction;
-    while (activeTransaction->id != NULL) {
-        if (strcmp(activeTransaction->id, transaction) == 0) {
+    const char* owner = sd_bus_message_get_sender(m);
+
+    if ((newTransaction = registry_find(registry, transaction)) != NULL) {
+        if (!shared || !newTransaction->shared) {
             sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "The transaction is currently in use by another thread.");
             return -EBUSY;
         }
-        activeTransaction = activeTransaction->next;
+        newTransaction->users++;
+        if (ret_entry != NULL) {
+            *ret_entry = newTransaction;
+        }
+        return 0;
     }
-    if ((newTransaction = malloc(sizeof(TransactionEntry))) == NULL) {
+    if ((newTransaction = calloc(1, sizeof(TransactionEntry))) == NULL) {
         sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Error while allocating space for transaction.");
         return -ENOMEM;
     }
-    newTransaction->id = NULL;
-    activeTransaction->id = strdup(transaction);
-    if (activeTransaction->id == NULL) {
-        free(newTransaction);
+    pthread_mutex_init(&newTransaction->txlock, NULL);
+    newTransaction->nsfd = -1;
+    newTransaction->id = strdup(transaction);
+    newTransaction->owner = strdup(owner ? owner : "");
+    if (newTransaction->id == NULL || newTransaction->owner == NULL) {
+        registry_free_entry(newTransaction);
         sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Error during strdup.");
         return -ENOMEM;
     }
-    activeTransaction->state = queued;
-    activeTransaction->next = newTransaction;
+    newTransaction->started = now_usec();
+    atomic_init(&newTransaction->state, queued);
+    atomic_init(&newTransaction->progress, 0);
+    atomic_init(&newTransaction->active, 0);
+    newTransaction->users = 1;
+    newTransaction->shared = shared;
+
+    size_t bucket = registry_hash(transaction);
+    newTransaction->next = registry->buckets[bucket];
+    registry->buckets[bucket] = newTransaction;
+    registry->size++;
+
+    if (ret_entry != NULL) {
+        *ret_entry = newTransaction;
+    }
     return 0;
 }
 
 void unlockSnapshot(void* userdata, const char* transaction) {
-    TransactionEntry* activeTransaction = userdata;
-    TransactionEntry* prevNext = NULL;
-
-    while (activeTransaction->id != NULL) {
-        // The entry point can't be changed, so just set the data of the to be deleted
-        // transaction to the next entry's data (also for later matches to have just one code
-        // path).
-        if (strcmp(activeTransaction->id, transaction) == 0) {
-            fprintf(stdout, "Unlocking snapshot %s...\n", transaction);
-            free(activeTransaction->id);
-            activeTransaction->id = activeTransaction->next->id;
-            prevNext = activeTransaction->next;
-            if (activeTransaction->id != NULL) {
-                activeTransaction->next = activeTransaction->next->next;
+    TransactionRegistry* registry = userdata;
+    TransactionEntry** link = &registry->buckets[registry_hash(transaction)];
+
+    while (*link != NULL) {
+        if (strcmp((*link)->id, transaction) == 0) {
+            TransactionEntry* entry = *link;
+            if (--entry->users > 0) {
+                return;
             }
-            free(prevNext);
+            fprintf(stdout, "Unlocking snapshot %s...\n", transaction);
+            *link = entry->next;
+            registry_free_entry(entry);
+            registry->size--;
             return;
         }
-        activeTransaction = activeTransaction->next;
+        link = &(*link)->next;
     }
 }
 
-sd_bus* get_bus() {
-    sd_bus *bus = NULL;
-    if (sd_bus_default_system(&bus) < 0) {
-        // When opening a new bus connection fails there aren't a lot of options to present this
-        // error to the user here. Maybe add some synchronization with the main thread and exit
-        // on error in the future?
-        fprintf(stderr, "Failed to connect to system bus.");
+// The bind mounts of a transaction only exist in the mount namespace of the thread which
+// initialized or resumed it (e.g. the spare's own thread, see spare_fill_func), so any other
+// thread finishing or freeing it has to switch to that namespace first.
+static int mntns_enter(int nsfd) {
+    if (unshare(CLONE_FS) < 0 || setns(nsfd, CLONE_NEWNS) < 0) {
+        fprintf(stderr, "Cannot enter mount namespace of transaction: %s\n", strerror(errno));
+        return -1;
     }
-    return bus;
+    return 0;
 }
 
-int emit_internal_signal(sd_bus *bus, const char *transaction, const char* signame, const char *types, ...) {
-    va_list ap;
-    _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
-    int ret;
+// Like mntns_enter, for threads which have to return to their own namespace afterwards (e.g.
+// the main event loop, whose namespace is inherited by all new threads); returns the previous
+// namespace for mntns_leave, or -1 on error
+static int mntns_switch(int nsfd) {
+    int saved = open("/proc/thread-self/ns/mnt", O_RDONLY | O_CLOEXEC);
+    if (saved < 0) {
+        fprintf(stderr, "Cannot open current mount namespace: %s\n", strerror(errno));
+        return -1;
+    }
+    if (mntns_enter(nsfd) != 0) {
+        close(saved);
+        return -1;
+    }
+    return saved;
+}
 
-    if ((ret = sd_bus_message_new_signal(bus, &m, "/org/opensuse/tukit/internal", "org.opensuse.tukit.internal", signame)) != 0) {
-        fprintf(stderr, "Error during sd_bus_message_new_signal for %s (Transaction %s): %s\n", signame, transaction, strerror(ret));
+static void mntns_leave(int saved) {
+    if (setns(saved, CLONE_NEWNS) < 0) {
+        fprintf(stderr, "Cannot return to previous mount namespace: %s\n", strerror(errno));
     }
-    va_start(ap, types);
-    if (ret >= 0 && (ret = sd_bus_message_appendv(m, "sis", ap)) < 0) {
-        fprintf(stderr, "Error during sd_bus_message_appendv for %s (Transaction %s): %s\n", signame, transaction, strerror(ret));
+    close(saved);
+}
+
+// Frees a transaction within the mount namespace nsfd (if not -1) and closes it; the calling
+// thread stays in its own namespace
+static void mntns_free_tx(struct tukit_tx* tx, int nsfd) {
+    int saved = -1;
+
+    if (nsfd >= 0) {
+        saved = mntns_switch(nsfd);
+        close(nsfd);
     }
-    va_end(ap);
-    if (ret >= 0 && (ret = sd_bus_send_to(bus, m, "org.opensuse.tukit", NULL)) < 0) {
-        fprintf(stderr, "Error during sd_bus_send_to for %s (Transaction %s): %s\n", signame, transaction, strerror(ret));
+    tukit_free_tx(tx);
+    if (saved >= 0) {
+        mntns_leave(saved);
     }
+}
 
-    if (ret < 0)
-        return ret;
-    else
-        return 0;
+static void spare_free(struct tukit_tx* tx, char* base, int nsfd) {
+    // Not kept, so the snapshot will be deleted again
+    mntns_free_tx(tx, nsfd);
+    free(base);
+}
+
+static void *spare_fill_func(void *args) {
+    SpareSnapshot* spare = args;
+    struct tukit_tx* tx;
+    char* base;
+    int nsfd;
+
+    for (;;) {
+        if ((base = (char*)tukit_sm_get_default()) == NULL) {
+            break;
+        }
+        if ((tx = tukit_new_tx()) == NULL) {
+            free(base);
+            break;
+        }
+        if (tukit_tx_init(tx, base) != 0) {
+            tukit_free_tx(tx);
+            free(base);
+            break;
+        }
+        if ((nsfd = open("/proc/thread-self/ns/mnt", O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "Cannot open mount namespace of spare snapshot: %s\n", strerror(errno));
+            tukit_free_tx(tx);
+            free(base);
+            break;
+        }
+
+        pthread_mutex_lock(&spare->lock);
+        if (spare->stale) {
+            spare->stale = 0;
+            pthread_mutex_unlock(&spare->lock);
+            tukit_free_tx(tx);
+            free(base);
+            close(nsfd);
+            continue;
+        }
+        spare->tx = tx;
+        spare->base = base;
+        spare->nsfd = nsfd;
+        spare->state = spare_ready;
+        pthread_mutex_unlock(&spare->lock);
+        fprintf(stdout, "Spare snapshot of snapshot %s prepared.\n", base);
+        return NULL;
+    }
+
+    fprintf(stderr, "Preparing spare snapshot failed: %s\n", tukit_get_errmsg());
+    pthread_mutex_lock(&spare->lock);
+    spare->stale = 0;
+    spare->state = spare_empty;
+    pthread_mutex_unlock(&spare->lock);
+    return NULL;
 }
 
-int send_error_signal(sd_bus *bus, const char *transaction, const char *message, int error) {
-    if (bus == NULL) {
-        bus = get_bus();
+// Prepare a new spare snapshot in the background if there is none
+static void spare_refill(SpareSnapshot* spare) {
+    pthread_t fill_thread;
+
+    pthread_mutex_lock(&spare->lock);
+    if (spare->state == spare_empty) {
+        if (pthread_create(&fill_thread, NULL, spare_fill_func, spare) == 0) {
+            pthread_detach(fill_thread);
+            spare->state = spare_filling;
+        } else {
+            fprintf(stderr, "Cannot start thread for spare snapshot.\n");
+        }
     }
-    int ret = emit_internal_signal(bus, transaction, "Error", "sis", transaction, error, message);
-    if (ret < 0) {
-        // Something is seriously broken when even an error message can't be sent any more...
-        fprintf(stderr, "Cannot reach D-Bus any more: %s\n", strerror(ret));
+    pthread_mutex_unlock(&spare->lock);
+}
+
+// Discards the spare snapshot after the default snapshot changed and prepares a new one
+static void spare_invalidate(SpareSnapshot* spare) {
+    struct tukit_tx* tx = NULL;
+    char* base = NULL;
+    int nsfd = -1;
+
+    pthread_mutex_lock(&spare->lock);
+    if (spare->state == spare_ready) {
+        tx = spare->tx;
+        base = spare->base;
+        nsfd = spare->nsfd;
+        spare->tx = NULL;
+        spare->base = NULL;
+        spare->nsfd = -1;
+        spare->state = spare_empty;
+    } else if (spare->state == spare_filling) {
+        spare->stale = 1;
+    }
+    pthread_mutex_unlock(&spare->lock);
+
+    if (tx != NULL) {
+        spare_free(tx, base, nsfd);
+    }
+    spare_refill(spare);
+}
+
+// Returns the spare snapshot if it is still based on the current default snapshot, NULL
+// otherwise. On success ret_nsfd will be set to the spare's mount namespace, which the
+// transaction has to be used in (see mntns_enter); it has to be closed by the caller.
+static struct tukit_tx* spare_claim(SpareSnapshot* spare, int* ret_nsfd) {
+    struct tukit_tx* tx;
+    char* base;
+    char* current;
+    int nsfd;
+
+    pthread_mutex_lock(&spare->lock);
+    if (spare->state != spare_ready) {
+        pthread_mutex_unlock(&spare->lock);
+        return NULL;
+    }
+    tx = spare->tx;
+    base = spare->base;
+    nsfd = spare->nsfd;
+    spare->tx = NULL;
+    spare->base = NULL;
+    spare->nsfd = -1;
+    spare->state = spare_empty;
+    pthread_mutex_unlock(&spare->lock);
+
+    current = (char*)tukit_sm_get_default();
+    if (current == NULL || strcmp(current, base) != 0) {
+        fprintf(stdout, "Discarding outdated spare snapshot of snapshot %s.\n", base);
+        spare_free(tx, base, nsfd);
+        tx = NULL;
+    } else {
+        fprintf(stdout, "Using spare snapshot of snapshot %s.\n", base);
+        free(base);
+        *ret_nsfd = nsfd;
     }
-    sd_bus_flush_close_unref(bus);
-    return ret;
+    free(current);
+
+    spare_refill(spare);
+    return tx;
+}
+
+// D-Bus connections must not be shared between threads, so worker threads don't emit any
+// signals themselves. Instead they queue their results here and wake up the main event
+// loop, which will send all pending signals on its own connection (see result_handler).
+static int queue_result(ResultQueue *results, const char *transaction, const char *signame, int returncode, const char *output, size_t len, int unlock) {
+    TransactionResult *result = calloc(1, sizeof(TransactionResult));
+    if (result == NULL) {
+        fprintf(stderr, "Error while allocating space for result of transaction %s.\n", transaction);
+        return -ENOMEM;
+    }
+    result->id = strdup(transaction ? transaction : "");
+    result->output = malloc(len + 1);
+    if (result->id == NULL || result->output == NULL) {
+        free(result->id);
+        free(result->output);
+        free(result);
+        fprintf(stderr, "Error during strdup for result of transaction %s.\n", transaction);
+        return -ENOMEM;
+    }
+    if (len > 0)
+        memcpy(result->output, output, len);
+    result->output[len] = '\0';
+    result->len = len;
+    result->signal = signame;
+    result->returncode = returncode;
+    result->unlock = unlock;
+
+    pthread_mutex_lock(&results->lock);
+    *results->tail = result;
+    results->tail = &result->next;
+    pthread_mutex_unlock(&results->lock);
+
+    if (eventfd_write(results->fd, 1) < 0) {
+        fprintf(stderr, "Cannot wake up main loop for %s (Transaction %s): %s\n", signame, transaction, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+int post_result(ResultQueue *results, const char *transaction, const char *signame, int returncode, const char *output) {
+    return queue_result(results, transaction, signame, returncode, output, output ? strlen(output) : 0, 1);
+}
+
+int send_error_signal(ResultQueue *results, const char *transaction, const char *message, int error) {
+    return post_result(results, transaction, "Error", error, message);
+}
+
+// Error after the request's final result has been posted already, e.g. if the reboot failed;
+// the snapshot may be locked by another request by then
+static int send_late_error_signal(ResultQueue *results, const char *transaction, const char *message, int error) {
+    return queue_result(results, transaction, "Error", error, message, message ? strlen(message) : 0, 0);
+}
+
+// Output callback for streaming mode: forward every chunk of the command's output as an
+// OutputChunk signal instead of collecting it for the final CommandExecuted signal.
+static void stream_output(const char *data, size_t len, void *userdata) {
+    struct output_stream *os = userdata;
+    queue_result(os->results, os->transaction, "OutputChunk", 0, data, len, 0);
 }
 
 static void *execute_func(void *args) {
     int ret = 0;
     int exec_ret = 0;
     wordexp_t p;
-    const char* transaction = NULL;
 
     struct execute_args* ea = (struct execute_args*)args;
     struct tukit_tx* tx = ea->transaction;
+    char *transaction = ea->snapid;
     char *command = strdup(ea->command);
     char *rebootmethod = strdup(ea->rebootmethod);
-
-
-    enum transactionstates *state = ea->state;
-    *state = running;
-
-    // D-Bus doesn't support connection sharing between several threads, so a new dbus connection
-    // has to be established. The bus will only be initialized directly before it is used to
-    // avoid timeouts.
-    sd_bus *bus = NULL;
-
-    if (command == NULL || rebootmethod == NULL) {
-        send_error_signal(bus, rebootmethod, "Error during strdup.", -ENOMEM);
-        goto finish_execute;
+    int stream = ea->stream;
+    TransactionEntry *entry = ea->entry;
+    ResultQueue *results = ea->results;
+    SpareSnapshot *spare = ea->spare;
+    int nsfd = ea->nsfd;
+    int finalized = 0;
+
+    atomic_store(&entry->state, running);
+
+    if (nsfd >= 0) {
+        ret = mntns_enter(nsfd);
+        close(nsfd);
+        if (ret != 0) {
+            send_error_signal(results, transaction, "Cannot enter mount namespace of spare snapshot.", -1);
+            goto finish_execute;
+        }
     }
 
-    transaction = tukit_tx_get_snapshot(tx);
-    if (tx == NULL) {
-        send_error_signal(bus, transaction, tukit_get_errmsg(), -1);
+    if (command == NULL || rebootmethod == NULL) {
+        send_error_signal(results, transaction, "Error during strdup.", -ENOMEM);
         goto finish_execute;
     }
 
@@ -177,46 +516,59 @@ static void *execute_func(void *args) {
         if (ret == WRDE_NOSPACE) {
             wordfree(&p);
         }
-        send_error_signal(bus, transaction, "Command could not be processed.", ret);
+        send_error_signal(results, transaction, "Command could not be processed.", ret);
         goto finish_execute;
     }
 
-    const char* output;
-    exec_ret = tukit_tx_execute(tx, p.we_wordv, &output);
+    const char* output = NULL;
+    if (stream) {
+        struct output_stream os = { results, transaction };
+        exec_ret = tukit_tx_execute_stream(tx, p.we_wordv, stream_output, &os);
+    } else {
+        exec_ret = tukit_tx_execute(tx, p.we_wordv, &output);
+    }
+    atomic_fetch_add(&entry->progress, 1);
 
     wordfree(&p);
 
     // Discard snapshot on error
     if (exec_ret != 0) {
-        send_error_signal(bus, transaction, output, exec_ret);
+        atomic_store(&entry->state, finished);
+        send_error_signal(results, transaction, output, exec_ret);
+        free((void*)output);
         goto finish_execute;
     }
 
     if ((ret = tukit_tx_finalize(tx)) != 0) {
-        send_error_signal(bus, transaction, tukit_get_errmsg(), -1);
+        atomic_store(&entry->state, finished);
+        free((void*)output);
+        send_error_signal(results, transaction, tukit_get_errmsg(), -1);
         goto finish_execute;
     }
+    atomic_fetch_add(&entry->progress, 1);
+    atomic_store(&entry->state, finished);
 
-    bus = get_bus();
-
-    ret = emit_internal_signal(bus, transaction, "CommandExecuted", "sis", transaction, exec_ret, output);
-    if (ret < 0) {
-        send_error_signal(bus, transaction, "Cannot send signal 'CommandExecuted'.", ret);
-    }
+    ret = post_result(results, transaction, "CommandExecuted", exec_ret, output);
+    finalized = 1;
 
     free((void*)output);
 
-    if (strcmp(rebootmethod, "none") != 0) {
-        if (tukit_reboot(rebootmethod) != 0){
-            bus = get_bus();
-            send_error_signal(bus, transaction, tukit_get_errmsg(), -1);
+finish_execute:
+    // Release this transaction's mounts before the spare snapshot is replaced
+    tukit_free_tx(tx);
+
+    if (finalized) {
+        // The spare snapshot is based on the previous default snapshot
+        spare_invalidate(spare);
+
+        if (strcmp(rebootmethod, "none") != 0) {
+            if (tukit_reboot(rebootmethod) != 0){
+                send_late_error_signal(results, transaction, tukit_get_errmsg(), -1);
+            }
         }
     }
 
-finish_execute:
-    sd_bus_flush_close_unref(bus);
-    tukit_free_tx(tx);
-    free((void*)transaction);
+    free(transaction);
     free(command);
     free(rebootmethod);
 
@@ -228,9 +580,12 @@ static int transaction_execute(sd_bus_message *m, void *userdata, sd_bus_error *
     const char *snapid = NULL;
     char *description = NULL;
     char *rebootmethod = "none";
+    int stream = 0;
+    int discard = 0;
+    int custom_config = 0;
     pthread_t execute_thread;
     struct execute_args exec_args;
-    TransactionEntry* activeTransaction = userdata;
+    TransactionEntry* entry = NULL;
     int ret = 0;
     char type;
 
@@ -264,6 +619,26 @@ static int transaction_execute(sd_bus_message *m, void *userdata, sd_bus_error *
                             sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not open variant container.");
                             return -1;
                         }
+                    } else if (strcmp(optionname, "Stream") == 0) {
+                        if (sd_bus_message_enter_container(m, 'v', "b") >= 0) {
+                            if (sd_bus_message_read(m, "b", &stream) < 0) {
+                                sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not decode 'Stream' option value.");
+                                return -1;
+                            }
+                        } else {
+                            sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not open variant container.");
+                            return -1;
+                        }
+                    } else if (strcmp(optionname, "DiscardIfUnchanged") == 0) {
+                        if (sd_bus_message_enter_container(m, 'v', "b") >= 0) {
+                            if (sd_bus_message_read(m, "b", &discard) < 0) {
+                                sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not decode 'DiscardIfUnchanged' option value.");
+                                return -1;
+                            }
+                        } else {
+                            sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not open variant container.");
+                            return -1;
+                        }
                     } else if (strcmp(optionname, "Description") == 0) {
                         if (sd_bus_message_enter_container(m, 'v', "s") >= 0) {
                             if (sd_bus_message_read(m, "s", &description) < 0) {
@@ -282,6 +657,7 @@ static int transaction_execute(sd_bus_message *m, void *userdata, sd_bus_error *
                                 return -1;
                             }
                             tukit_set_config(optionname, value);
+                            custom_config = 1;
                         }
                     }
                     if (sd_bus_message_exit_container(m) < 0) {
@@ -307,14 +683,21 @@ static int transaction_execute(sd_bus_message *m, void *userdata, sd_bus_error *
         }
     }
 
-    struct tukit_tx* tx = tukit_new_tx();
-    if (tx == NULL) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
-        return -1;
+    struct tukit_tx* tx = NULL;
+    int nsfd = -1;
+    if (strcmp(base, "default") == 0 && description == NULL && !discard && !custom_config) {
+        tx = spare_claim(&((TransactionRegistry*)userdata)->spare, &nsfd);
     }
-    if ((ret = tukit_tx_init_with_desc(tx, base, description)) != 0) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
-        goto finish_execute;
+    if (tx == NULL) {
+        if ((tx = tukit_new_tx()) == NULL) {
+            sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
+            return -1;
+        }
+        tukit_tx_discard_if_unchanged(tx, discard);
+        if ((ret = tukit_tx_init_with_desc(tx, base, description)) != 0) {
+            sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
+            goto finish_execute;
+        }
     }
     if ((snapid = tukit_tx_get_snapshot(tx)) == NULL) {
         sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
@@ -322,29 +705,39 @@ static int transaction_execute(sd_bus_message *m, void *userdata, sd_bus_error *
         goto finish_execute;
     }
 
-    if ((ret = lockSnapshot(userdata, snapid, ret_error)) != 0) {
+    if ((ret = lockSnapshot(userdata, m, snapid, 0, &entry, ret_error)) != 0) {
         goto finish_execute;
     }
 
     if ((ret = sd_bus_emit_signal(sd_bus_message_get_bus(m), "/org/opensuse/tukit", "org.opensuse.tukit.Transaction", "TransactionOpened", "s", snapid)) < 0) {
         sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Sending signal 'TransactionOpened' failed.");
+        unlockSnapshot(userdata, snapid);
         goto finish_execute;
     }
 
     fprintf(stdout, "Snapshot %s created.\n", snapid);
 
-    while (activeTransaction->next->id != NULL) {
-        activeTransaction = activeTransaction->next;
+    if ((exec_args.snapid = strdup(snapid)) == NULL) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Error during strdup.");
+        unlockSnapshot(userdata, snapid);
+        ret = -ENOMEM;
+        goto finish_execute;
     }
     exec_args.transaction = tx;
-    exec_args.state = &activeTransaction->state;
+    exec_args.entry = entry;
+    exec_args.results = &((TransactionRegistry*)userdata)->results;
+    exec_args.spare = &((TransactionRegistry*)userdata)->spare;
+    exec_args.nsfd = nsfd;
     exec_args.rebootmethod = rebootmethod;
+    exec_args.stream = stream;
 
     if ((ret = pthread_create(&execute_thread, NULL, execute_func, &exec_args)) != 0) {
+        free(exec_args.snapid);
+        unlockSnapshot(userdata, snapid);
         goto finish_execute;
     }
 
-    while (activeTransaction->state != running) {
+    while (atomic_load(&entry->state) == queued) {
         usleep(500);
     }
 
@@ -357,7 +750,7 @@ static int transaction_execute(sd_bus_message *m, void *userdata, sd_bus_error *
     return ret;
 
 finish_execute:
-    tukit_free_tx(tx);
+    mntns_free_tx(tx, nsfd);
     if (snapid != NULL) {
         free((void*)snapid);
     }
@@ -369,6 +762,8 @@ static int transaction_open(sd_bus_message *m, void *userdata, sd_bus_error *ret
     char *base;
     char *desc = NULL;
     const char *snapid;
+    int discard = 0;
+    int custom_config = 0;
     int ret = 0;
 
     if (sd_bus_message_read(m, "s", &base) < 0) {
@@ -389,6 +784,16 @@ static int transaction_open(sd_bus_message *m, void *userdata, sd_bus_error *ret
                         sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not open variant container.");
                         return -1;
                     }
+                } else if (strcmp(optionname, "DiscardIfUnchanged") == 0) {
+                    if (sd_bus_message_enter_container(m, 'v', "b") >= 0) {
+                        if (sd_bus_message_read(m, "b", &discard) < 0) {
+                            sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not decode 'DiscardIfUnchanged' option value.");
+                            return -1;
+                        }
+                    } else {
+                        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not open variant container.");
+                        return -1;
+                    }
                 } else {
                     char *value;
                     if (sd_bus_message_enter_container(m, 'v', "s") >= 0) {
@@ -397,6 +802,7 @@ static int transaction_open(sd_bus_message *m, void *userdata, sd_bus_error *ret
                             return -1;
                         }
                         tukit_set_config(optionname, value);
+                        custom_config = 1;
                     }
                 }
                 if (sd_bus_message_exit_container(m) < 0) {
@@ -417,18 +823,34 @@ static int transaction_open(sd_bus_message *m, void *userdata, sd_bus_error *ret
             return -1;
         }
     }
-    struct tukit_tx* tx = tukit_new_tx();
-    if (tx == NULL) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
-        return -1;
+    struct tukit_tx* tx = NULL;
+    int nsfd = -1;
+    int saved = -1;
+    if (strcmp(base, "default") == 0 && desc == NULL && !discard && !custom_config) {
+        tx = spare_claim(&((TransactionRegistry*)userdata)->spare, &nsfd);
+    }
+    if (nsfd >= 0) {
+        // New threads inherit the namespace of the main event loop, so it must not stay there
+        if ((saved = mntns_switch(nsfd)) < 0) {
+            sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Cannot enter mount namespace of spare snapshot.");
+            ret = -1;
+        }
+        close(nsfd);
     }
-    if (desc) {
-        if ((ret = tukit_tx_init_with_desc(tx, base, desc)) != 0) {
+    if (tx == NULL) {
+        if ((tx = tukit_new_tx()) == NULL) {
             sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
+            return -1;
         }
-    } else {
-        if ((ret = tukit_tx_init(tx, base)) != 0) {
-            sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
+        tukit_tx_discard_if_unchanged(tx, discard);
+        if (desc) {
+            if ((ret = tukit_tx_init_with_desc(tx, base, desc)) != 0) {
+                sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
+            }
+        } else {
+            if ((ret = tukit_tx_init(tx, base)) != 0) {
+                sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
+            }
         }
     }
     if (!ret) {
@@ -443,6 +865,9 @@ static int transaction_open(sd_bus_message *m, void *userdata, sd_bus_error *ret
     }
 
     tukit_free_tx(tx);
+    if (saved >= 0) {
+        mntns_leave(saved);
+    }
     if (ret) {
         return ret;
     }
@@ -459,79 +884,146 @@ static int transaction_open(sd_bus_message *m, void *userdata, sd_bus_error *ret
     return ret;
 }
 
+// Concurrent Calls on the same snapshot share one resumed transaction, so the commands run
+// in parallel in the same prepared environment instead of mounting it several times. The
+// first Call resumes the transaction, the last one to finish keeps it again; all of them
+// work in the mount namespace the first one created.
+static struct tukit_tx* acquire_tx(TransactionEntry* entry, char* transaction, const char** errmsg) {
+    struct tukit_tx* tx = NULL;
+
+    pthread_mutex_lock(&entry->txlock);
+    if (entry->tx == NULL) {
+        if ((tx = tukit_new_tx()) == NULL) {
+            *errmsg = tukit_get_errmsg();
+            goto finish_acquire;
+        }
+        if (tukit_tx_resume(tx, transaction) != 0) {
+            *errmsg = tukit_get_errmsg();
+            tukit_free_tx(tx);
+            tx = NULL;
+            goto finish_acquire;
+        }
+        if ((entry->nsfd = open("/proc/thread-self/ns/mnt", O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "Cannot open mount namespace of transaction %s: %s\n", transaction, strerror(errno));
+            *errmsg = "Cannot open mount namespace of transaction.";
+            // Don't discard the snapshot
+            tukit_tx_keep(tx);
+            tukit_free_tx(tx);
+            tx = NULL;
+            goto finish_acquire;
+        }
+        entry->tx = tx;
+    } else if (mntns_enter(entry->nsfd) != 0) {
+        *errmsg = "Cannot enter mount namespace of transaction.";
+        goto finish_acquire;
+    }
+    tx = entry->tx;
+    entry->txusers++;
+
+finish_acquire:
+    pthread_mutex_unlock(&entry->txlock);
+    return tx;
+}
+
+static int release_tx(TransactionEntry* entry, char** errmsg) {
+    int ret = 0;
+
+    pthread_mutex_lock(&entry->txlock);
+    if (--entry->txusers == 0) {
+        if ((ret = tukit_tx_keep(entry->tx)) != 0) {
+            *errmsg = strdup(tukit_get_errmsg());
+        }
+        tukit_free_tx(entry->tx);
+        entry->tx = NULL;
+        close(entry->nsfd);
+        entry->nsfd = -1;
+    }
+    pthread_mutex_unlock(&entry->txlock);
+    return ret;
+}
+
+// Must be called before the Call's result is posted, the entry may be freed afterwards
+static void call_done(TransactionEntry* entry) {
+    if (atomic_fetch_sub(&entry->active, 1) == 1) {
+        atomic_store(&entry->state, finished);
+    }
+}
+
 static void *call_func(void *args) {
     int ret = 0;
     int exec_ret = 0;
     wordexp_t p;
     struct tukit_tx* tx = NULL;
+    char *errmsg = NULL;
 
     struct call_args* ea = (struct call_args*)args;
-    char *transaction = strdup(ea->transaction);
-    char *command = strdup(ea->command);
+    char *transaction = ea->transaction;
+    char *command = ea->command;
     int chrooted = ea->chrooted;
+    int stream = ea->stream;
+    TransactionEntry *entry = ea->entry;
+    ResultQueue *results = ea->results;
+    free(ea);
 
-    enum transactionstates *state = ea->state;
-    *state = running;
+    atomic_fetch_add(&entry->active, 1);
+    atomic_store(&entry->state, running);
 
     fprintf(stdout, "Executing command `%s` in snapshot %s...\n", command, transaction);
 
-    // D-Bus doesn't support connection sharing between several threads, so a new dbus connection
-    // has to be established. The bus will only be initialized directly before it is used to
-    // avoid timeouts.
-    sd_bus *bus = NULL;
-
-    if (command == NULL || transaction == NULL) {
-        send_error_signal(bus, transaction, "Error during strdup.", -ENOMEM);
-        goto finish_execute;
-    }
-
-    tx = tukit_new_tx();
+    const char* acquire_err = NULL;
+    tx = acquire_tx(entry, transaction, &acquire_err);
     if (tx == NULL) {
-        send_error_signal(bus, transaction, tukit_get_errmsg(), -1);
-        goto finish_execute;
-    }
-    ret = tukit_tx_resume(tx, transaction);
-    if (ret != 0) {
-        send_error_signal(bus, transaction, tukit_get_errmsg(), ret);
+        call_done(entry);
+        send_error_signal(results, transaction, acquire_err, -1);
         goto finish_execute;
     }
+    atomic_fetch_add(&entry->progress, 1);
 
     ret = wordexp(command, &p, 0);
     if (ret != 0) {
         if (ret == WRDE_NOSPACE) {
             wordfree(&p);
         }
-        send_error_signal(bus, transaction, "Command could not be processed.", ret);
+        release_tx(entry, &errmsg);
+        call_done(entry);
+        send_error_signal(results, transaction, "Command could not be processed.", ret);
         goto finish_execute;
     }
 
-    const char* output;
+    const char* output = NULL;
+    struct output_stream os = { results, transaction };
     if (chrooted) {
-        exec_ret = tukit_tx_execute(tx, p.we_wordv, &output);
+        if (stream)
+            exec_ret = tukit_tx_execute_stream(tx, p.we_wordv, stream_output, &os);
+        else
+            exec_ret = tukit_tx_execute(tx, p.we_wordv, &output);
     } else {
-        exec_ret = tukit_tx_call_ext(tx, p.we_wordv, &output);
+        if (stream)
+            exec_ret = tukit_tx_call_ext_stream(tx, p.we_wordv, stream_output, &os);
+        else
+            exec_ret = tukit_tx_call_ext(tx, p.we_wordv, &output);
     }
+    atomic_fetch_add(&entry->progress, 1);
 
     wordfree(&p);
 
-    ret = tukit_tx_keep(tx);
+    // The entry may be freed as soon as the result has been posted, so release it first
+    ret = release_tx(entry, &errmsg);
     if (ret != 0) {
         free((void*)output);
-        send_error_signal(bus, transaction, tukit_get_errmsg(), -1);
+        call_done(entry);
+        send_error_signal(results, transaction, errmsg, -1);
         goto finish_execute;
     }
+    atomic_fetch_add(&entry->progress, 1);
+    call_done(entry);
 
-    bus = get_bus();
-    ret = emit_internal_signal(bus, transaction, "CommandExecuted", "sis", transaction, exec_ret, output);
-    if (ret < 0) {
-        send_error_signal(bus, transaction, "Cannot send signal 'CommandExecuted'.", ret);
-    }
+    ret = post_result(results, transaction, "CommandExecuted", exec_ret, output);
 
     free((void*)output);
 
 finish_execute:
-    sd_bus_flush_close_unref(bus);
-    tukit_free_tx(tx);
+    free(errmsg);
     free(transaction);
     free(command);
 
@@ -542,10 +1034,13 @@ static int call_common(sd_bus_message *m, void *userdata,
            sd_bus_error *ret_error, const int chrooted) {
     int ret;
     pthread_t execute_thread;
-    struct call_args exec_args;
-    TransactionEntry* activeTransaction = userdata;
+    struct call_args* exec_args;
+    char *transaction;
+    char *command;
+    TransactionEntry* entry = NULL;
+    int stream = 0;
 
-    if (sd_bus_message_read(m, "ss", &exec_args.transaction, &exec_args.command) < 0) {
+    if (sd_bus_message_read(m, "ss", &transaction, &command) < 0) {
         sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read D-Bus parameters.");
         return -1;
     }
@@ -563,6 +1058,16 @@ static int call_common(sd_bus_message *m, void *userdata,
                         sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not open variant container.");
                         return -1;
                     }
+                } else if (strcmp(optionname, "Stream") == 0) {
+                    if (sd_bus_message_enter_container(m, 'v', "b") >= 0) {
+                        if (sd_bus_message_read(m, "b", &stream) < 0) {
+                            sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not decode 'Stream' option value.");
+                            return -1;
+                        }
+                    } else {
+                        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not open variant container.");
+                        return -1;
+                    }
                 } else {
                     char *value;
                     if (sd_bus_message_enter_container(m, 'v', "s") >= 0) {
@@ -592,23 +1097,39 @@ static int call_common(sd_bus_message *m, void *userdata,
         }
     }
 
-    ret = lockSnapshot(userdata, exec_args.transaction, ret_error);
+    ret = lockSnapshot(userdata, m, transaction, 1, &entry, ret_error);
     if (ret != 0) {
         return ret;
     }
 
-    while (activeTransaction->next->id != NULL) {
-        activeTransaction = activeTransaction->next;
+    // Owned by the worker thread; with a shared lock the entry may already be running, so
+    // waiting for the state to change can't be used to keep the arguments alive
+    if ((exec_args = calloc(1, sizeof(struct call_args))) == NULL) {
+        unlockSnapshot(userdata, transaction);
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Error while allocating space for call arguments.");
+        return -ENOMEM;
     }
-    exec_args.chrooted = chrooted;
-    exec_args.state = &activeTransaction->state;
-
-    if ((ret = pthread_create(&execute_thread, NULL, call_func, &exec_args)) != 0) {
-        return ret;
+    exec_args->transaction = strdup(transaction);
+    exec_args->command = strdup(command);
+    if (exec_args->transaction == NULL || exec_args->command == NULL) {
+        free(exec_args->transaction);
+        free(exec_args->command);
+        free(exec_args);
+        unlockSnapshot(userdata, transaction);
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Error during strdup.");
+        return -ENOMEM;
     }
+    exec_args->chrooted = chrooted;
+    exec_args->stream = stream;
+    exec_args->entry = entry;
+    exec_args->results = &((TransactionRegistry*)userdata)->results;
 
-    while (activeTransaction->state != running) {
-        usleep(500);
+    if ((ret = pthread_create(&execute_thread, NULL, call_func, exec_args)) != 0) {
+        free(exec_args->transaction);
+        free(exec_args->command);
+        free(exec_args);
+        unlockSnapshot(userdata, transaction);
+        return ret;
     }
 
     pthread_detach(execute_thread);
@@ -630,38 +1151,50 @@ static int transaction_callext(sd_bus_message *m, void *userdata, sd_bus_error *
     return sd_bus_reply_method_return(m, "");
 }
 
-static int signalCallback(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    const char *member;
-    char *transaction;
-    int exec_ret = 0;
-    const char* output;
-
-    if ((member = sd_bus_message_get_member(m)) < 0) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read member name.");
-        return -1;
-    }
-    if (strcmp(member, "CommandExecuted") == 0) {
-        if (sd_bus_message_read(m, "sis", &transaction, &exec_ret, &output) < 0) {
-            sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read CommandExecuted signal data.");
-            return -1;
-        }
-
-        int ret = sd_bus_emit_signal(sd_bus_message_get_bus(m), "/org/opensuse/tukit/Transaction", "org.opensuse.tukit.Transaction", "CommandExecuted", "sis", transaction, exec_ret, output);
-        if (ret < 0) {
-            send_error_signal(sd_bus_message_get_bus(m), transaction, "Cannot send signal 'CommandExecuted'.", ret);
-        }
-        unlockSnapshot(userdata, transaction);
-    } else if (strcmp(member, "Error") == 0) {
-        if (sd_bus_message_read(m, "sis", &transaction, &exec_ret, &output) < 0) {
-            sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read CommandExecuted signal data.");
-            return -1;
+static int result_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    TransactionRegistry* registry = userdata;
+    eventfd_t count;
+
+    if (eventfd_read(fd, &count) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "Could not read from result queue: %s\n", strerror(errno));
+    }
+
+    // Take all pending results at once, so workers finishing in the meantime don't block
+    // on the lock while the signals are sent.
+    pthread_mutex_lock(&registry->results.lock);
+    TransactionResult* result = registry->results.head;
+    registry->results.head = NULL;
+    registry->results.tail = &registry->results.head;
+    pthread_mutex_unlock(&registry->results.lock);
+
+    while (result != NULL) {
+        TransactionResult* next = result->next;
+        if (strcmp(result->signal, "OutputChunk") == 0) {
+            // Output of a still running command; may contain arbitrary bytes
+            _cleanup_(sd_bus_message_unrefp) sd_bus_message *signal = NULL;
+            int ret = sd_bus_message_new_signal(registry->bus, &signal, "/org/opensuse/tukit/Transaction", "org.opensuse.tukit.Transaction", "OutputChunk");
+            if (ret >= 0)
+                ret = sd_bus_message_append(signal, "s", result->id);
+            if (ret >= 0)
+                ret = sd_bus_message_append_array(signal, 'y', result->output, result->len);
+            if (ret >= 0)
+                ret = sd_bus_send(registry->bus, signal, NULL);
+            if (ret < 0) {
+                fprintf(stderr, "Cannot send signal '%s' (Transaction %s): %s\n", result->signal, result->id, strerror(-ret));
+            }
+        } else {
+            int ret = sd_bus_emit_signal(registry->bus, "/org/opensuse/tukit/Transaction", "org.opensuse.tukit.Transaction", result->signal, "sis", result->id, result->returncode, result->output);
+            if (ret < 0) {
+                fprintf(stderr, "Cannot send signal '%s' (Transaction %s): %s\n", result->signal, result->id, strerror(-ret));
+            }
         }
-
-        int ret = sd_bus_emit_signal(sd_bus_message_get_bus(m), "/org/opensuse/tukit/Transaction", "org.opensuse.tukit.Transaction", "Error", "sis", transaction, exec_ret, output);
-        if (ret < 0) {
-            send_error_signal(sd_bus_message_get_bus(m), transaction, "Cannot send signal 'Error'.", ret);
+        if (result->unlock) {
+            unlockSnapshot(registry, result->id);
         }
-        unlockSnapshot(userdata, transaction);
+        free(result->id);
+        free(result->output);
+        free(result);
+        result = next;
     }
     return 0;
 }
@@ -704,7 +1237,7 @@ static int transaction_close(sd_bus_message *m, void *userdata, sd_bus_error *re
             return -1;
         }
     }
-    ret = lockSnapshot(userdata, transaction, ret_error);
+    ret = lockSnapshot(userdata, m, transaction, 0, NULL, ret_error);
     if (ret != 0) {
         return ret;
     }
@@ -729,6 +1262,12 @@ finish_close:
     tukit_free_tx(tx);
     unlockSnapshot(userdata, transaction);
 
+    // The spare snapshot is based on the previous default snapshot; only discard it after the
+    // closed transaction's mounts are gone
+    if (!ret) {
+        spare_invalidate(&((TransactionRegistry*)userdata)->spare);
+    }
+
     if (ret)
         return ret;
     return sd_bus_reply_method_return(m, "");
@@ -772,7 +1311,7 @@ static int transaction_abort(sd_bus_message *m, void *userdata, sd_bus_error *re
             return -1;
         }
     }
-    ret = lockSnapshot(userdata, transaction, ret_error);
+    ret = lockSnapshot(userdata, m, transaction, 0, NULL, ret_error);
     if (ret != 0) {
         return ret;
     }
@@ -798,6 +1337,56 @@ finish_abort:
     return sd_bus_reply_method_return(m, "");
 }
 
+static int transaction_list(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    TransactionRegistry* registry = userdata;
+    sd_bus_message *message = NULL;
+    int ret = 0;
+
+    if ((ret = sd_bus_message_new_method_return(m, &message)) < 0) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Creating new return method failed.");
+        goto finish_transactionlist;
+    }
+    if ((ret = sd_bus_message_open_container(message, 'a', "(ssstu)")) < 0) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Creating container (array of transactions) failed.");
+        goto finish_transactionlist;
+    }
+    for (size_t i = 0; i < REGISTRY_BUCKETS; i++) {
+        for (TransactionEntry* entry = registry->buckets[i]; entry != NULL; entry = entry->next) {
+            if ((ret = sd_bus_message_append(message, "(ssstu)", entry->id,
+                            transactionstate_names[atomic_load(&entry->state)], entry->owner,
+                            entry->started, atomic_load(&entry->progress))) < 0) {
+                sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Appending transaction failed.");
+                goto finish_transactionlist;
+            }
+        }
+    }
+    if ((ret = sd_bus_message_close_container(message)) < 0) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Closing container (array of transactions) failed.");
+        goto finish_transactionlist;
+    }
+    if ((ret = sd_bus_send(sd_bus_message_get_bus(message), message, NULL)) < 0) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Sending message failed.");
+        goto finish_transactionlist;
+    }
+
+finish_transactionlist:
+    sd_bus_message_unref(message);
+    return ret;
+}
+
+static int transaction_get_metrics(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    const char *metrics;
+    int ret = 0;
+
+    if ((metrics = tukit_get_metrics()) == NULL) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
+        return -1;
+    }
+    ret = sd_bus_reply_method_return(m, "s", metrics);
+    free((void*)metrics);
+    return ret;
+}
+
 static int snapshot_list(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
     char *columns;
     size_t list_len = 0;
@@ -887,7 +1476,7 @@ static int snapshot_delete(sd_bus_message *m, void *userdata, sd_bus_error *ret_
         return -1;
     }
 
-    ret = lockSnapshot(userdata, snapshot, ret_error);
+    ret = lockSnapshot(userdata, m, snapshot, 0, NULL, ret_error);
     if (ret != 0) {
         return ret;
     }
@@ -904,6 +1493,45 @@ static int snapshot_delete(sd_bus_message *m, void *userdata, sd_bus_error *ret_
     return sd_bus_reply_method_return(m, "");
 }
 
+static int snapshot_delete_many(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    char **snapshots = NULL;
+    size_t count = 0;
+    size_t locked = 0;
+    int ret = 0;
+
+    if (sd_bus_message_read_strv(m, &snapshots) < 0) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read D-Bus parameters.");
+        return -1;
+    }
+    while (snapshots != NULL && snapshots[count] != NULL) {
+        count++;
+    }
+
+    for (locked = 0; locked < count; locked++) {
+        if ((ret = lockSnapshot(userdata, m, snapshots[locked], 0, NULL, ret_error)) != 0) {
+            goto finish_delete;
+        }
+    }
+
+    fprintf(stdout, "Deleting %zu snapshots...\n", count);
+    if ((ret = tukit_sm_deletesnaps((const char**)snapshots, count)) < 0) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
+    }
+
+finish_delete:
+    for (size_t i = 0; i < locked; i++) {
+        unlockSnapshot(userdata, snapshots[i]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(snapshots[i]);
+    }
+    free(snapshots);
+    if (ret != 0) {
+        return ret;
+    }
+    return sd_bus_reply_method_return(m, "");
+}
+
 static int snapshot_rollback(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
     char *snapshot;
     int ret = 0;
@@ -921,12 +1549,13 @@ static int snapshot_rollback(sd_bus_message *m, void *userdata, sd_bus_error *re
     }
 
     fprintf(stdout, "Rollback to snapshot %s.\n", snapshot);
+    spare_invalidate(&((TransactionRegistry*)userdata)->spare);
     return sd_bus_reply_method_return(m, "");
 }
 
 int event_handler(sd_event_source *s, const struct signalfd_siginfo *si, void *userdata) {
-    TransactionEntry* activeTransaction = userdata;
-    if (activeTransaction->id != NULL) {
+    TransactionRegistry* registry = userdata;
+    if (registry->size > 0) {
         fprintf(stdout, "Waiting for remaining transactions to finish...\n");
         sleep(1);
         kill(si->ssi_pid, si->ssi_signo);
@@ -956,9 +1585,12 @@ static const sd_bus_vtable tukit_transaction_vtable[] = {
     SD_BUS_METHOD_WITH_ARGS("CloseWithOpts", SD_BUS_ARGS("s", transaction, "a{sv}", options), SD_BUS_NO_RESULT, transaction_close, 0),
     SD_BUS_METHOD_WITH_ARGS("Abort", SD_BUS_ARGS("s", transaction), SD_BUS_NO_RESULT, transaction_abort, 0),
     SD_BUS_METHOD_WITH_ARGS("AbortWithOpts", SD_BUS_ARGS("s", transaction, "a{sv}", options), SD_BUS_NO_RESULT, transaction_abort, 0),
+    SD_BUS_METHOD_WITH_ARGS("ListTransactions", SD_BUS_NO_ARGS, SD_BUS_RESULT("a(ssstu)", transactions), transaction_list, 0),
+    SD_BUS_METHOD_WITH_ARGS("GetMetrics", SD_BUS_NO_ARGS, SD_BUS_RESULT("s", metrics), transaction_get_metrics, 0),
     SD_BUS_SIGNAL_WITH_ARGS("TransactionOpened", SD_BUS_ARGS("s", snapshot), 0),
     SD_BUS_SIGNAL_WITH_ARGS("CommandExecuted", SD_BUS_ARGS("s", snapshot, "i", returncode, "s", output), 0),
     SD_BUS_SIGNAL_WITH_ARGS("Error", SD_BUS_ARGS("s", snapshot, "i", returncode, "s", output), 0),
+    SD_BUS_SIGNAL_WITH_ARGS("OutputChunk", SD_BUS_ARGS("s", snapshot, "ay", data), 0),
     SD_BUS_VTABLE_END
 };
 
@@ -966,6 +1598,7 @@ static const sd_bus_vtable tukit_snapshot_vtable[] = {
     SD_BUS_VTABLE_START(0),
     SD_BUS_METHOD_WITH_ARGS("List", SD_BUS_ARGS("s", columns), SD_BUS_RESULT("aa{ss}", list), snapshot_list, 0),
     SD_BUS_METHOD_WITH_ARGS("Delete", SD_BUS_ARGS("s", snapshot), SD_BUS_NO_RESULT, snapshot_delete, 0),
+    SD_BUS_METHOD_WITH_ARGS("DeleteMany", SD_BUS_ARGS("as", snapshots), SD_BUS_NO_RESULT, snapshot_delete_many, 0),
     SD_BUS_METHOD_WITH_ARGS("RollbackTo", SD_BUS_ARGS("s", snapshot), SD_BUS_NO_RESULT, snapshot_rollback, 0),
     SD_BUS_VTABLE_END
 };
@@ -986,19 +1619,28 @@ int main() {
         return EXIT_FAILURE;
     }
 
-    TransactionEntry* activeTransactions = (TransactionEntry*) malloc(sizeof(TransactionEntry));
+    TransactionRegistry* activeTransactions = (TransactionRegistry*) calloc(1, sizeof(TransactionRegistry));
     if (activeTransactions == NULL) {
-        fprintf(stderr, "malloc failed for TransactionEntry.\n");
+        fprintf(stderr, "malloc failed for TransactionRegistry.\n");
+        goto finish;
+    }
+    pthread_mutex_init(&activeTransactions->results.lock, NULL);
+    pthread_mutex_init(&activeTransactions->spare.lock, NULL);
+    activeTransactions->spare.nsfd = -1;
+    activeTransactions->results.tail = &activeTransactions->results.head;
+    activeTransactions->results.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (activeTransactions->results.fd < 0) {
+        ret = -errno;
+        fprintf(stderr, "Failed to create result queue: %s\n", strerror(-ret));
         goto finish;
     }
-    activeTransactions->id = NULL;
-    activeTransactions->state = queued;
 
     ret = sd_bus_open_system(&bus);
     if (ret < 0) {
         fprintf(stderr, "Failed to connect to system bus: %s\n", strerror(-ret));
         goto finish;
     }
+    activeTransactions->bus = bus;
 
     ret = sd_bus_add_object_vtable(bus,
                                    &slot_tx,
@@ -1029,19 +1671,6 @@ int main() {
         goto finish;
     }
 
-    ret = sd_bus_match_signal(bus,
-                NULL,
-                NULL,
-                "/org/opensuse/tukit/internal",
-                NULL,
-                NULL,
-                signalCallback,
-                activeTransactions);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to register internal signal listener: %s\n", strerror(-ret));
-        goto finish;
-    }
-
     ret = sd_event_default(&event);
     if (ret < 0) {
         fprintf(stderr, "Failed to create default event loop: %s\n", strerror(-ret));
@@ -1068,12 +1697,24 @@ int main() {
         fprintf(stderr, "Could not add signal handler for SIGINT to event loop: %s\n", strerror(-ret));
         goto finish;
     }
+    ret = sd_event_add_io(event, NULL, activeTransactions->results.fd, EPOLLIN, result_handler, activeTransactions);
+    if (ret < 0) {
+        fprintf(stderr, "Could not add result queue to event loop: %s\n", strerror(-ret));
+        goto finish;
+    }
     ret = sd_bus_attach_event(bus, event, 0);
     if (ret < 0) {
         fprintf(stderr, "Could not add sd-bus handling to event bus: %s\n", strerror(-ret));
         goto finish;
     }
 
+    const char* spare_enabled = tukit_get_config("SPARE_SNAPSHOT");
+    if (spare_enabled != NULL && strcmp(spare_enabled, "true") == 0) {
+        activeTransactions->spare.state = spare_empty;
+        spare_refill(&activeTransactions->spare);
+    }
+    free((void*)spare_enabled);
+
     ret = sd_event_loop(event);
     if (ret < 0) {
         fprintf(stderr, "Error while running event loop: %s\n", strerror(-ret));
@@ -1081,11 +1722,32 @@ int main() {
     }
 
 finish:
-    while (activeTransactions && activeTransactions->id != NULL) {
-        TransactionEntry* nextTransaction = activeTransactions->next;
-        free(activeTransactions->id);
-        free(activeTransactions);
-        activeTransactions = nextTransaction;
+    // A spare snapshot which is still being prepared will be left behind as an unfinished
+    // transaction and removed by the next cleanup
+    if (activeTransactions) {
+        pthread_mutex_lock(&activeTransactions->spare.lock);
+        if (activeTransactions->spare.state == spare_ready) {
+            spare_free(activeTransactions->spare.tx, activeTransactions->spare.base, activeTransactions->spare.nsfd);
+        }
+        activeTransactions->spare.state = spare_disabled;
+        pthread_mutex_unlock(&activeTransactions->spare.lock);
+    }
+    for (size_t i = 0; activeTransactions && i < REGISTRY_BUCKETS; i++) {
+        while (activeTransactions->buckets[i] != NULL) {
+            TransactionEntry* nextTransaction = activeTransactions->buckets[i]->next;
+            registry_free_entry(activeTransactions->buckets[i]);
+            activeTransactions->buckets[i] = nextTransaction;
+        }
+    }
+    while (activeTransactions && activeTransactions->results.head != NULL) {
+        TransactionResult* nextResult = activeTransactions->results.head->next;
+        free(activeTransactions->results.head->id);
+        free(activeTransactions->results.head->output);
+        free(activeTransactions->results.head);
+        activeTransactions->results.head = nextResult;
+    }
+    if (activeTransactions && activeTransactions->results.fd >= 0) {
+        close(activeTransactions->results.fd);
     }
     free(activeTransactions);
     sd_event_unref(event);
@@ -4,18 +4,85 @@
 #include "libtukit.h"
 #include "Configuration.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 #include "Reboot.hpp"
 #include "Transaction.hpp"
 #include "SnapshotManager.hpp"
 #include <algorithm>
+#include <atomic>
 #include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <thread>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include <vector>
 
 using namespace TransactionalUpdate;
 thread_local std::string errmsg;
 
+// State of an asynchronous operation: the operation runs in its own thread and signals its
+// completion via an eventfd, so callers can wait for any number of transactions in their
+// own event loop.
+struct AsyncOperation {
+    std::thread worker;
+    int fd = -1;
+    std::atomic<bool> done{false};
+    int ret = -1;
+    std::string output;
+    std::string error;
+    std::vector<std::string> args;
+    ~AsyncOperation() {
+        if (worker.joinable())
+            worker.join();
+        if (fd >= 0)
+            close(fd);
+    }
+};
+static std::mutex asyncLock;
+static std::map<tukit_tx, std::unique_ptr<AsyncOperation>> asyncOps;
+
+static int startAsync(tukit_tx tx, std::unique_ptr<AsyncOperation> op, std::function<int(Transaction*, AsyncOperation*)> operation) {
+    Transaction* transaction = reinterpret_cast<Transaction*>(tx);
+    try {
+        std::lock_guard<std::mutex> lock{asyncLock};
+        if (asyncOps.count(tx))
+            throw std::runtime_error{"Another asynchronous operation is still pending for this transaction."};
+        op->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (op->fd < 0)
+            throw std::runtime_error{"Creating eventfd failed: " + std::string(strerror(errno))};
+        AsyncOperation* current = op.get();
+        current->worker = std::thread([transaction, current, operation]() {
+            try {
+                current->ret = operation(transaction, current);
+            } catch (const std::exception &e) {
+                current->error = e.what();
+                current->ret = -1;
+            }
+            current->done = true;
+            eventfd_write(current->fd, 1);
+        });
+        asyncOps[tx] = std::move(op);
+        return current->fd;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
+
+static std::unique_ptr<AsyncOperation> takeAsync(tukit_tx tx) {
+    std::lock_guard<std::mutex> lock{asyncLock};
+    auto it = asyncOps.find(tx);
+    if (it == asyncOps.end())
+        return nullptr;
+    auto op = std::move(it->second);
+    asyncOps.erase(it);
+    return op;
+}
+
 const char* tukit_get_errmsg() {
     return errmsg.c_str();
 }
@@ -35,6 +102,15 @@ int tukit_set_logoutput(char* fields) {
 void tukit_set_config(char* key, char* value) {
     config.set(key, value);
 }
+const char* tukit_get_config(char* key) {
+    try {
+        return strdup(config.get(key).c_str());
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return nullptr;
+    }
+}
 tukit_tx tukit_new_tx() {
     Transaction* transaction = nullptr;
     try {
@@ -47,6 +123,8 @@ tukit_tx tukit_new_tx() {
 }
 void tukit_free_tx(tukit_tx tx) {
     if (tx != nullptr) {
+        // Wait for a pending asynchronous operation
+        takeAsync(tx).reset();
         delete reinterpret_cast<Transaction*>(tx);
     }
 }
@@ -132,6 +210,30 @@ int tukit_tx_call_ext(tukit_tx tx, char* argv[], const char* output[]) {
         return -1;
     }
 }
+int tukit_tx_execute_stream(tukit_tx tx, char* argv[], tukit_output_callback callback, void* userdata) {
+    Transaction* transaction = reinterpret_cast<Transaction*>(tx);
+    try {
+        return transaction->execute(argv, [callback, userdata](const char* data, size_t len) {
+            callback(data, len, userdata);
+        });
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
+int tukit_tx_call_ext_stream(tukit_tx tx, char* argv[], tukit_output_callback callback, void* userdata) {
+    Transaction* transaction = reinterpret_cast<Transaction*>(tx);
+    try {
+        return transaction->callExt(argv, [callback, userdata](const char* data, size_t len) {
+            callback(data, len, userdata);
+        });
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
 int tukit_tx_finalize(tukit_tx tx) {
     Transaction* transaction = reinterpret_cast<Transaction*>(tx);
     try {
@@ -165,6 +267,54 @@ int tukit_tx_send_signal(tukit_tx tx, int signal) {
     }
     return 0;
 }
+int tukit_tx_execute_async(tukit_tx tx, char* argv[]) {
+    auto op = std::make_unique<AsyncOperation>();
+    // The caller's argv doesn't have to stay valid until the command is started
+    for (int i = 0; argv[i] != nullptr; i++)
+        op->args.push_back(argv[i]);
+    return startAsync(tx, std::move(op), [](Transaction* transaction, AsyncOperation* op) {
+        std::vector<char*> args;
+        for (auto& arg: op->args)
+            args.push_back(arg.data());
+        args.push_back(nullptr);
+        return transaction->execute(args.data(), &op->output);
+    });
+}
+int tukit_tx_finalize_async(tukit_tx tx) {
+    return startAsync(tx, std::make_unique<AsyncOperation>(), [](Transaction* transaction, AsyncOperation*) {
+        transaction->finalize();
+        return 0;
+    });
+}
+int tukit_tx_poll(tukit_tx tx) {
+    std::lock_guard<std::mutex> lock{asyncLock};
+    auto it = asyncOps.find(tx);
+    if (it == asyncOps.end()) {
+        errmsg = "No asynchronous operation pending for this transaction.";
+        fprintf(stderr, "ERROR: %s\n", errmsg.c_str());
+        return -1;
+    }
+    return it->second->done ? 1 : 0;
+}
+/* Free output with free() */
+int tukit_tx_result(tukit_tx tx, const char* output[]) {
+    auto op = takeAsync(tx);
+    if (op == nullptr) {
+        errmsg = "No asynchronous operation pending for this transaction.";
+        fprintf(stderr, "ERROR: %s\n", errmsg.c_str());
+        return -1;
+    }
+    op->worker.join();
+    if (!op->error.empty()) {
+        fprintf(stderr, "ERROR: %s\n", op->error.c_str());
+        errmsg = op->error;
+        return -1;
+    }
+    if (output) {
+        *output = strdup(op->output.c_str());
+    }
+    return op->ret;
+}
 int tukit_tx_is_initialized(tukit_tx tx) {
     Transaction* transaction = reinterpret_cast<Transaction*>(tx);
     return transaction->isInitialized();
@@ -180,6 +330,16 @@ const char* tukit_tx_get_snapshot(tukit_tx tx) {
         return nullptr;
     }
 }
+const char* tukit_tx_get_timings(tukit_tx tx) {
+    Transaction* transaction = reinterpret_cast<Transaction*>(tx);
+    try {
+        return strdup(transaction->getTimings().c_str());
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return nullptr;
+    }
+}
 const char* tukit_tx_get_root(tukit_tx tx) {
     Transaction* transaction = reinterpret_cast<Transaction*>(tx);
     try {
@@ -262,6 +422,36 @@ int tukit_sm_deletesnap(const char* id) {
     }
 }
 
+int tukit_sm_deletesnaps(const char* ids[], size_t len) {
+    try {
+        std::unique_ptr<TransactionalUpdate::SnapshotManager> snapshotMgr = TransactionalUpdate::SnapshotFactory::get();
+        snapshotMgr->deleteSnaps(std::vector<std::string>(ids, ids + len));
+        return 0;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
+
+int tukit_sm_modifysnaps(const char* ids[], size_t len, const char* cleanup, const char* userdata) {
+    try {
+        std::unique_ptr<TransactionalUpdate::SnapshotManager> snapshotMgr = TransactionalUpdate::SnapshotFactory::get();
+        std::optional<std::string> cleanupAlgorithm;
+        std::optional<std::string> data;
+        if (cleanup != nullptr)
+            cleanupAlgorithm = cleanup;
+        if (userdata != nullptr)
+            data = userdata;
+        snapshotMgr->modifySnaps(std::vector<std::string>(ids, ids + len), cleanupAlgorithm, data);
+        return 0;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
+
 int tukit_sm_rollbackto(const char* id) {
     try {
         std::unique_ptr<TransactionalUpdate::SnapshotManager> snapshotMgr = TransactionalUpdate::SnapshotFactory::get();
@@ -285,3 +475,13 @@ int tukit_reboot(const char* method) {
     }
     return 0;
 }
+
+const char* tukit_get_metrics() {
+    try {
+        return strdup(TransactionalUpdate::metrics.format().c_str());
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return nullptr;
+    }
+}
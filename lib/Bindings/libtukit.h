@@ -23,6 +23,8 @@ const char* tukit_get_errmsg();
 void tukit_set_loglevel(tukit_loglevel lv);
 int tukit_set_logoutput(char *fields);
 void tukit_set_config(char* key, char* value);
+/* Free with free() */
+const char* tukit_get_config(char* key);
 typedef void* tukit_tx;
 tukit_tx tukit_new_tx();
 void tukit_free_tx(tukit_tx tx);
@@ -30,21 +32,49 @@ int tukit_tx_init(tukit_tx tx, char* base);
 int tukit_tx_init_with_desc(tukit_tx tx, char* base, char* description);
 int tukit_tx_discard_if_unchanged(tukit_tx tx, int discard);
 int tukit_tx_resume(tukit_tx tx, char* id);
+/* Commands may be executed from several threads at once. tukit_tx_finalize, tukit_tx_keep and
+   tukit_free_tx have to be called in the mount namespace of the thread which initialized or
+   resumed the transaction, see Transaction::execute(). */
 int tukit_tx_execute(tukit_tx tx, char* argv[], const char* output[]);
 int tukit_tx_call_ext(tukit_tx tx, char* argv[], const char* output[]);
+/* Called for every chunk of output; data is not null terminated */
+typedef void (*tukit_output_callback)(const char* data, size_t len, void* userdata);
+int tukit_tx_execute_stream(tukit_tx tx, char* argv[], tukit_output_callback callback, void* userdata);
+int tukit_tx_call_ext_stream(tukit_tx tx, char* argv[], tukit_output_callback callback, void* userdata);
 int tukit_tx_finalize(tukit_tx tx);
 int tukit_tx_keep(tukit_tx tx);
 int tukit_tx_send_signal(tukit_tx tx, int signal);
+/* Asynchronous variants: Return an eventfd which becomes readable as soon as the operation
+   has finished, or -1 on error. Only one operation may be pending per transaction; apart from
+   tukit_tx_send_signal (e.g. to cancel a running command) no other function may be called on
+   the transaction until the result has been collected with tukit_tx_result. */
+int tukit_tx_execute_async(tukit_tx tx, char* argv[]);
+int tukit_tx_finalize_async(tukit_tx tx);
+/* Returns 1 if the pending operation has finished, 0 if it is still running */
+int tukit_tx_poll(tukit_tx tx);
+/* Waits for the pending operation and returns its result; closes the eventfd.
+   Free output with free() */
+int tukit_tx_result(tukit_tx tx, const char* output[]);
 int tukit_tx_is_initialized(tukit_tx tx);
 const char* tukit_tx_get_snapshot(tukit_tx tx);
 const char* tukit_tx_get_root(tukit_tx tx);
+/* Returns a JSON object; free with free() */
+const char* tukit_tx_get_timings(tukit_tx tx);
+/* Free the returned snapshot IDs with free() */
+const char* tukit_sm_get_current();
+const char* tukit_sm_get_default();
 typedef void* tukit_sm_list;
 tukit_sm_list tukit_sm_get_list(size_t* len, const char* columns);
 const char* tukit_sm_get_list_value(tukit_sm_list list, size_t row, char* columns);
 void tukit_free_sm_list(tukit_sm_list list);
 int tukit_sm_deletesnap(const char* id);
+int tukit_sm_deletesnaps(const char* ids[], size_t len);
+/* cleanup and userdata may be NULL to leave them unchanged */
+int tukit_sm_modifysnaps(const char* ids[], size_t len, const char* cleanup, const char* userdata);
 int tukit_sm_rollbackto(const char* id);
 int tukit_reboot(const char* method);
+/* Returns the metrics of this process in the Prometheus text format; free with free() */
+const char* tukit_get_metrics();
 
 #ifdef __cplusplus
 }
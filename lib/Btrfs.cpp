@@ -0,0 +1,269 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Helper functions for btrfs subvolume handling
+ */
+
+#include "Btrfs.hpp"
+#include "Log.hpp"
+#include <cerrno>
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <functional>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <linux/magic.h>
+#include <stdexcept>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+namespace TransactionalUpdate {
+
+// Directory file descriptor which will be closed when going out of scope
+class DirFd {
+public:
+    DirFd(const fs::path& path): fd{open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)} {
+        if (fd < 0)
+            throw std::runtime_error{"Opening '" + path.native() + "' failed: " + std::string(strerror(errno))};
+    }
+    ~DirFd() {
+        close(fd);
+    }
+    operator int() const { return fd; }
+private:
+    int fd;
+};
+
+static void ioctlOrThrow(int fd, unsigned long request, void* args, const std::string& what) {
+    if (ioctl(fd, request, args) < 0)
+        throw std::runtime_error{what + " failed: " + std::string(strerror(errno))};
+}
+
+// Calls fn for all items matching the given key, until fn returns false
+static void treeSearch(int fd, struct btrfs_ioctl_search_key key,
+        const std::function<bool(const struct btrfs_ioctl_search_header& header, const char* data)>& fn) {
+    struct btrfs_ioctl_search_args args;
+    for (;;) {
+        memset(&args, 0, sizeof(args));
+        key.nr_items = 4096;
+        args.key = key;
+        ioctlOrThrow(fd, BTRFS_IOC_TREE_SEARCH, &args, "Searching btrfs tree " + std::to_string(key.tree_id));
+        if (args.key.nr_items == 0)
+            return;
+
+        struct btrfs_ioctl_search_header header;
+        size_t pos = 0;
+        for (unsigned int i = 0; i < args.key.nr_items; i++) {
+            memcpy(&header, args.buf + pos, sizeof(header));
+            pos += sizeof(header);
+            if (!fn(header, args.buf + pos))
+                return;
+            pos += header.len;
+        }
+
+        // Continue after the last item
+        if (header.offset < (uint64_t)-1) {
+            key.min_offset = header.offset + 1;
+            key.min_type = header.type;
+            key.min_objectid = header.objectid;
+        } else if (header.type < 255) {
+            key.min_offset = 0;
+            key.min_type = header.type + 1;
+            key.min_objectid = header.objectid;
+        } else if (header.objectid < (uint64_t)-1) {
+            key.min_offset = 0;
+            key.min_type = 0;
+            key.min_objectid = header.objectid + 1;
+        } else {
+            return;
+        }
+    }
+}
+
+Btrfs::SubvolInfo Btrfs::getSubvolInfo(const fs::path& path) {
+    DirFd fd{path};
+    struct btrfs_ioctl_get_subvol_info_args args;
+    memset(&args, 0, sizeof(args));
+    ioctlOrThrow(fd, BTRFS_IOC_GET_SUBVOL_INFO, &args, "Reading subvolume information of '" + path.native() + "'");
+
+    SubvolInfo info;
+    info.id = args.treeid;
+    info.parentId = args.parent_id;
+    memcpy(info.uuid.data(), args.uuid, info.uuid.size());
+    memcpy(info.parentUuid.data(), args.parent_uuid, info.parentUuid.size());
+    return info;
+}
+
+bool Btrfs::isSubvolume(const fs::path& path) {
+    struct stat st;
+    struct statfs sfs;
+    if (lstat(path.c_str(), &st) < 0 || !S_ISDIR(st.st_mode))
+        return false;
+    if (statfs(path.c_str(), &sfs) < 0 || sfs.f_type != BTRFS_SUPER_MAGIC)
+        return false;
+    return st.st_ino == BTRFS_FIRST_FREE_OBJECTID;
+}
+
+uint64_t Btrfs::findSubvolume(const fs::path& fsPath, const Uuid& uuid) {
+    DirFd fd{fsPath};
+    uint64_t uuidHigh;
+    uint64_t uuidLow;
+    memcpy(&uuidHigh, uuid.data(), sizeof(uuidHigh));
+    memcpy(&uuidLow, uuid.data() + sizeof(uuidHigh), sizeof(uuidLow));
+
+    struct btrfs_ioctl_search_key key;
+    memset(&key, 0, sizeof(key));
+    key.tree_id = BTRFS_UUID_TREE_OBJECTID;
+    key.min_objectid = key.max_objectid = le64toh(uuidHigh);
+    key.min_type = key.max_type = BTRFS_UUID_KEY_SUBVOL;
+    key.min_offset = key.max_offset = le64toh(uuidLow);
+    key.max_transid = (uint64_t)-1;
+
+    uint64_t id = 0;
+    treeSearch(fd, key, [&id](const struct btrfs_ioctl_search_header& header, const char* data) {
+        if (header.len < sizeof(id))
+            return true;
+        memcpy(&id, data, sizeof(id));
+        id = le64toh(id);
+        return false;
+    });
+    if (id == 0)
+        throw std::runtime_error{"No subvolume with the given UUID found."};
+    return id;
+}
+
+fs::path Btrfs::getSubvolumePath(const fs::path& fsPath, uint64_t id) {
+    DirFd fd{fsPath};
+    std::string path;
+
+    while (id != BTRFS_FS_TREE_OBJECTID) {
+        struct btrfs_ioctl_search_key key;
+        memset(&key, 0, sizeof(key));
+        key.tree_id = BTRFS_ROOT_TREE_OBJECTID;
+        key.min_objectid = key.max_objectid = id;
+        key.min_type = key.max_type = BTRFS_ROOT_BACKREF_KEY;
+        key.max_offset = (uint64_t)-1;
+        key.max_transid = (uint64_t)-1;
+
+        uint64_t parent = 0;
+        uint64_t dirid = 0;
+        std::string name;
+        treeSearch(fd, key, [&](const struct btrfs_ioctl_search_header& header, const char* data) {
+            struct btrfs_root_ref ref;
+            if (header.len < sizeof(ref))
+                return true;
+            memcpy(&ref, data, sizeof(ref));
+            parent = header.offset;
+            dirid = le64toh(ref.dirid);
+            name = std::string(data + sizeof(ref), le16toh(ref.name_len));
+            return false;
+        });
+        if (parent == 0)
+            throw std::runtime_error{"Subvolume " + std::to_string(id) + " not found."};
+
+        // Path of the directory containing the subvolume, relative to its parent subvolume
+        struct btrfs_ioctl_ino_lookup_args lookup;
+        memset(&lookup, 0, sizeof(lookup));
+        lookup.treeid = parent;
+        lookup.objectid = dirid;
+        ioctlOrThrow(fd, BTRFS_IOC_INO_LOOKUP, &lookup, "Looking up directory of subvolume " + std::to_string(id));
+
+        path = std::string(lookup.name) + name + (path.empty() ? "" : "/" + path);
+        id = parent;
+    }
+    return path;
+}
+
+void Btrfs::createSubvolume(const fs::path& path) {
+    DirFd parent{path.parent_path()};
+    struct btrfs_ioctl_vol_args args;
+    memset(&args, 0, sizeof(args));
+    if (path.filename().native().size() > BTRFS_PATH_NAME_MAX)
+        throw std::invalid_argument{"Subvolume name '" + path.filename().native() + "' is too long."};
+    strncpy(args.name, path.filename().c_str(), BTRFS_PATH_NAME_MAX);
+    tulog.debug("Creating subvolume ", path.native());
+    ioctlOrThrow(parent, BTRFS_IOC_SUBVOL_CREATE, &args, "Creating subvolume '" + path.native() + "'");
+}
+
+void Btrfs::createSnapshot(const fs::path& source, const fs::path& target, bool readOnly) {
+    DirFd sourceFd{source};
+    DirFd parent{target.parent_path()};
+    struct btrfs_ioctl_vol_args_v2 args;
+    memset(&args, 0, sizeof(args));
+    if (target.filename().native().size() > BTRFS_SUBVOL_NAME_MAX)
+        throw std::invalid_argument{"Snapshot name '" + target.filename().native() + "' is too long."};
+    args.fd = sourceFd;
+    args.flags = readOnly ? BTRFS_SUBVOL_RDONLY : 0;
+    strncpy(args.name, target.filename().c_str(), BTRFS_SUBVOL_NAME_MAX);
+    tulog.debug("Creating snapshot of ", source.native(), " in ", target.native());
+    ioctlOrThrow(parent, BTRFS_IOC_SNAP_CREATE_V2, &args, "Creating snapshot '" + target.native() + "' of '" + source.native() + "'");
+}
+
+void Btrfs::deleteSubvolume(const fs::path& path) {
+    DirFd parent{path.parent_path()};
+    struct btrfs_ioctl_vol_args args;
+    memset(&args, 0, sizeof(args));
+    strncpy(args.name, path.filename().c_str(), BTRFS_PATH_NAME_MAX);
+    tulog.debug("Deleting subvolume ", path.native());
+    ioctlOrThrow(parent, BTRFS_IOC_SNAP_DESTROY, &args, "Deleting subvolume '" + path.native() + "'");
+}
+
+bool Btrfs::isReadOnly(const fs::path& path) {
+    DirFd fd{path};
+    uint64_t flags = 0;
+    ioctlOrThrow(fd, BTRFS_IOC_SUBVOL_GETFLAGS, &flags, "Reading flags of subvolume '" + path.native() + "'");
+    return flags & BTRFS_SUBVOL_RDONLY;
+}
+
+void Btrfs::setReadOnly(const fs::path& path, bool readOnly) {
+    DirFd fd{path};
+    uint64_t flags = 0;
+    ioctlOrThrow(fd, BTRFS_IOC_SUBVOL_GETFLAGS, &flags, "Reading flags of subvolume '" + path.native() + "'");
+    if (readOnly == bool(flags & BTRFS_SUBVOL_RDONLY))
+        return;
+    if (readOnly)
+        flags |= BTRFS_SUBVOL_RDONLY;
+    else
+        flags &= ~BTRFS_SUBVOL_RDONLY;
+    ioctlOrThrow(fd, BTRFS_IOC_SUBVOL_SETFLAGS, &flags, "Setting flags of subvolume '" + path.native() + "'");
+}
+
+uint64_t Btrfs::getDefaultSubvolume(const fs::path& fsPath) {
+    DirFd fd{fsPath};
+
+    // The default subvolume is stored as the "default" entry of the root tree directory
+    struct btrfs_ioctl_search_key key;
+    memset(&key, 0, sizeof(key));
+    key.tree_id = BTRFS_ROOT_TREE_OBJECTID;
+    key.min_objectid = key.max_objectid = BTRFS_ROOT_TREE_DIR_OBJECTID;
+    key.min_type = key.max_type = BTRFS_DIR_ITEM_KEY;
+    key.max_offset = (uint64_t)-1;
+    key.max_transid = (uint64_t)-1;
+
+    uint64_t id = 0;
+    treeSearch(fd, key, [&id](const struct btrfs_ioctl_search_header& header, const char* data) {
+        struct btrfs_dir_item item;
+        if (header.len < sizeof(item))
+            return true;
+        memcpy(&item, data, sizeof(item));
+        if (std::string(data + sizeof(item), le16toh(item.name_len)) != "default")
+            return true;
+        id = le64toh(item.location.objectid);
+        return false;
+    });
+    // Without an entry the top level subvolume is the default one
+    return id ? id : BTRFS_FS_TREE_OBJECTID;
+}
+
+void Btrfs::setDefaultSubvolume(const fs::path& path) {
+    uint64_t id = getSubvolInfo(path).id;
+    DirFd fd{path};
+    tulog.debug("Setting default subvolume to ", path.native());
+    ioctlOrThrow(fd, BTRFS_IOC_DEFAULT_SUBVOL, &id, "Setting default subvolume to '" + path.native() + "'");
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Helper functions for btrfs subvolume handling, talking to the kernel
+  directly via ioctls instead of calling the btrfs tool.
+ */
+
+#ifndef T_U_BTRFS_H
+#define T_U_BTRFS_H
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace TransactionalUpdate {
+
+namespace fs = std::filesystem;
+
+struct Btrfs {
+    using Uuid = std::array<uint8_t, 16>;
+
+    struct SubvolInfo {
+        uint64_t id;
+        // ID of the subvolume containing this subvolume
+        uint64_t parentId;
+        Uuid uuid;
+        // UUID of the subvolume this one is a snapshot of; all zero otherwise
+        Uuid parentUuid;
+    };
+
+    static SubvolInfo getSubvolInfo(const fs::path& path);
+    static bool isSubvolume(const fs::path& path);
+    /**
+     * @brief Return the ID of the subvolume with the given UUID
+     * @param fsPath any path on the file system to search
+     */
+    static uint64_t findSubvolume(const fs::path& fsPath, const Uuid& uuid);
+    /**
+     * @brief Return the path of the subvolume with the given ID relative to the top level
+     * subvolume, e.g. "@/.snapshots/1/snapshot"
+     * @param fsPath any path on the file system to search
+     */
+    static fs::path getSubvolumePath(const fs::path& fsPath, uint64_t id);
+    static void createSubvolume(const fs::path& path);
+    static void createSnapshot(const fs::path& source, const fs::path& target, bool readOnly = false);
+    static void deleteSubvolume(const fs::path& path);
+    static bool isReadOnly(const fs::path& path);
+    static void setReadOnly(const fs::path& path, bool readOnly);
+    /**
+     * @brief Return the ID of the default subvolume (the one mounted without subvol option)
+     * @param fsPath any path on the file system to search
+     */
+    static uint64_t getDefaultSubvolume(const fs::path& fsPath);
+    static void setDefaultSubvolume(const fs::path& path);
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_BTRFS_H
@@ -26,7 +26,14 @@ Configuration::Configuration() {
         {"REBOOT_ALLOW_SOFT_REBOOT", "true"},
         {"REBOOT_ALLOW_KEXEC", "false"},
         {"OCI_TARGET", ""},
-        {"SNAPSHOT_MANAGER", "auto"}
+        {"METRICS_FILE", ""},
+        {"DEFER_SYNC", "false"},
+        {"SELINUX_RELABEL_THREADS", "0"},
+        {"SNAPSHOT_MANAGER", "auto"},
+        {"SNAPSHOT_NUMBER_LIMIT", "10"},
+        {"OVERLAY_DIR", "/var/lib/tukit/overlay"},
+        {"OVERLAY_BASE", ""},
+        {"SPARE_SNAPSHOT", "false"}
     };
     for(auto &[key, value] : defaults) {
         error = econf_setStringValue(kf_defaults, "", key, value);
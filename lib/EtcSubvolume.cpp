@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Handling of the /etc subvolume of snapper snapshots
+ */
+
+#include "EtcSubvolume.hpp"
+#include "Btrfs.hpp"
+#include "Log.hpp"
+#include "Snapshot/Snapper.hpp"
+#include "Timing.hpp"
+#include "Util.hpp"
+#include <algorithm>
+#include <fstream>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+// Makes a read-only subvolume writable until the end of the scope
+class WritableSubvolume {
+public:
+    WritableSubvolume(fs::path path): path{std::move(path)}, readOnly{Btrfs::isReadOnly(this->path)} {
+        if (readOnly)
+            Btrfs::setReadOnly(this->path, false);
+    }
+    ~WritableSubvolume() {
+        if (!readOnly)
+            return;
+        try {
+            Btrfs::setReadOnly(path, true);
+        } catch (const std::exception &e) {
+            tulog.error("ERROR: ", e.what());
+        }
+    }
+private:
+    fs::path path;
+    bool readOnly;
+};
+
+EtcSubvolume::EtcSubvolume(std::string snapshot): snapshot{std::move(snapshot)} {
+    if (this->snapshot.empty() || !std::all_of(this->snapshot.begin(), this->snapshot.end(), ::isdigit))
+        throw std::invalid_argument{"Invalid snapshot number '" + this->snapshot + "'."};
+}
+
+fs::path EtcSubvolume::getRoot(const std::string& snapshot) {
+    return fs::path{"/.snapshots"} / snapshot / "snapshot";
+}
+
+std::string EtcSubvolume::getParent() {
+    Btrfs::SubvolInfo info = Btrfs::getSubvolInfo(getRoot(snapshot));
+    if (info.parentUuid == Btrfs::Uuid{})
+        throw std::runtime_error{"Snapshot " + snapshot + " is not a snapshot of another subvolume."};
+    fs::path parentPath = Btrfs::getSubvolumePath("/", Btrfs::findSubvolume("/", info.parentUuid));
+
+    std::smatch match;
+    std::string path = parentPath.native();
+    if (!std::regex_search(path, match, std::regex{"(^|/)\\.snapshots/([0-9]+)/snapshot$"}))
+        throw std::runtime_error{"Parent subvolume '" + path + "' of snapshot " + snapshot + " is not a snapper snapshot."};
+    return match[2].str();
+}
+
+bool EtcSubvolume::create() {
+    ScopedTimer timer{"etc-subvolume-create"};
+    std::string parent = getParent();
+    fs::path parentEtc = getRoot(parent) / "etc";
+
+    if (!Btrfs::isSubvolume(parentEtc) ||
+            Btrfs::getSubvolInfo(parentEtc).parentId != Btrfs::getSubvolInfo(getRoot(parent)).id) {
+        tulog.info("Snapshot ", parent, " doesn't have an /etc subvolume.");
+        return false;
+    }
+
+    WritableSubvolume writable{getRoot(snapshot)};
+    // Nested subvolumes are not part of a snapshot, there's just an empty directory
+    fs::remove_all(getRoot(snapshot) / "etc");
+    Btrfs::createSnapshot(parentEtc, getRoot(snapshot) / "etc");
+    createSyncpoint(parent);
+    fixFstab();
+    return true;
+}
+
+void EtcSubvolume::createSyncpoint(const std::string& parent) {
+    fs::path etc = getRoot(snapshot) / "etc";
+    fs::path syncpoint = etc / "etc.syncpoint";
+    fs::path parentSyncpoint = getRoot(parent) / "etc" / "etc.syncpoint";
+
+    if (fs::is_directory(fs::symlink_status(syncpoint)))
+        fs::remove(syncpoint);
+
+    // Syncing is only necessary when the snapshot is based on the currently running system.
+    // "Current" means the snapshot number of the currently running /usr
+    std::string current;
+    try {
+        current = Snapper{}.getCurrent();
+    } catch (const std::exception &e) {
+        tulog.debug("Couldn't determine current snapshot: ", e.what());
+    }
+
+    std::string compareWith;
+    std::ifstream compareWithFile{parentSyncpoint / "transactional-update.comparewith"};
+    std::getline(compareWithFile, compareWith);
+
+    if (compareWithFile && !current.empty() && compareWith == current) {
+        // If the parent snapshot was created from the running system, perform a sync now and
+        // use the current running /etc as syncpoint. Snapshot first, then sync to avoid racing
+        // with changes to /etc in between.
+        Btrfs::createSnapshot("/etc", syncpoint);
+        Util::exec(std::string(LIBEXECDIR) + "/transactional-update-sync-etc-state --keep-syncpoint '" +
+                   syncpoint.native() + "' '" + etc.native() + "' '" + parentSyncpoint.native() + "'");
+        std::ofstream{syncpoint / "transactional-update.comparewith"} << current << "\n";
+    } else if (parent == current) {
+        // If it's the first descendant of the current system store a reference copy of the
+        // state before changes will be applied ...
+        Btrfs::createSnapshot(etc, syncpoint);
+        std::ofstream{syncpoint / "transactional-update.comparewith"} << parent << "\n";
+    } else if (fs::exists(parentSyncpoint)) {
+        // ... or if it's a consecutive snapshot, copy the already existing syncpoint
+        Btrfs::createSnapshot(parentSyncpoint, syncpoint);
+    }
+    // else: consecutive snapshot without syncpoint, skip syncing altogether
+}
+
+// Older versions didn't include the x-initrd.mount flag for /etc
+void EtcSubvolume::fixFstab() {
+    fs::path fstab = getRoot(snapshot) / "etc" / "fstab";
+    std::ifstream input{fstab};
+    if (!input)
+        return;
+
+    std::string content;
+    bool changed = false;
+    for (std::string line; std::getline(input, line); ) {
+        std::vector<std::string> fields;
+        std::stringstream fieldsStream{line};
+        for (std::string field; fieldsStream >> field; )
+            fields.push_back(field);
+        if (fields.size() >= 4 && fields[0][0] != '#' && fields[1] == "/etc" &&
+                fields[3].find("x-initrd.mount") == std::string::npos) {
+            fields[3] += ",x-initrd.mount";
+            line.clear();
+            for (auto& field: fields)
+                line += (line.empty() ? "" : " ") + field;
+            changed = true;
+        }
+        content += line + "\n";
+    }
+    input.close();
+
+    if (changed) {
+        tulog.info("Adding x-initrd.mount option to /etc in ", fstab.native());
+        std::ofstream output{fstab, std::ios::trunc};
+        output << content;
+        if (!output)
+            throw std::runtime_error{"Writing " + fstab.native() + " failed."};
+    }
+}
+
+void EtcSubvolume::remove() {
+    ScopedTimer timer{"etc-subvolume-remove"};
+    fs::path etc = getRoot(snapshot) / "etc";
+
+    // Only operate on snapshots with /etc as subvolume
+    if (!Btrfs::isSubvolume(etc))
+        return;
+    if (Btrfs::isReadOnly(getRoot(snapshot)))
+        Btrfs::setReadOnly(getRoot(snapshot), false);
+    if (Btrfs::isSubvolume(etc / "etc.syncpoint"))
+        Btrfs::deleteSubvolume(etc / "etc.syncpoint");
+    Btrfs::deleteSubvolume(etc);
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Handling of the /etc subvolume of snapper snapshots: Every snapshot has its
+  own nested /etc subvolume, which is created from the parent snapshot's /etc
+  together with the syncpoint used to merge changes of the running system into
+  the new snapshot. Used by snapper's 50-etc plugin.
+ */
+
+#ifndef T_U_ETCSUBVOLUME_H
+#define T_U_ETCSUBVOLUME_H
+
+#include <filesystem>
+#include <string>
+
+namespace TransactionalUpdate {
+
+namespace fs = std::filesystem;
+
+class EtcSubvolume {
+public:
+    EtcSubvolume(std::string snapshot);
+
+    /**
+     * @brief Create the /etc subvolume of a newly created snapshot
+     * @return false if the parent snapshot doesn't have an /etc subvolume yet (i.e. still
+     * uses an /etc overlay and has to be migrated), true otherwise
+     */
+    bool create();
+
+    /**
+     * @brief Delete the /etc subvolume and syncpoint of a snapshot which is about to be deleted
+     */
+    void remove();
+
+    /**
+     * @brief Return the number of the snapshot the snapshot was created from
+     */
+    std::string getParent();
+
+    /**
+     * @brief Create the syncpoint (reference state of /etc) of the snapshot
+     * @param parent Snapshot number of the parent snapshot
+     */
+    void createSyncpoint(const std::string& parent);
+
+private:
+    fs::path getRoot(const std::string& snapshot);
+    void fixFstab();
+    std::string snapshot;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_ETCSUBVOLUME_H
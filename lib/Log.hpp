@@ -8,86 +8,153 @@
 #ifndef T_U_LOG_H
 #define T_U_LOG_H
 
+#include <atomic>
+#include <cerrno>
 #include <exception>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <pthread.h>
+#include <sstream>
+#include <string>
+#include <sys/uio.h>
 #include <syslog.h>
+#include <systemd/sd-journal.h>
+#include <vector>
 
 enum class TULogLevel {
     None=0, Error, Info, Debug
 };
 struct TULogOutput {
-    bool console = true;
-    bool syslog = true;
+    std::atomic<bool> console = true;
+    std::atomic<bool> syslog = true;
 };
 
-// There's no threading in this application, so no locking is implemented
+// Structured fields added to journal messages. Each thread works on its own transaction
+// (e.g. tukitd's workers), so the context is kept per thread.
+struct TULogContext {
+    std::string transaction;
+    std::string stage;
+    std::string plugin;
+};
+inline thread_local TULogContext tulogContext{};
+
+// Sets a field of the log context and restores the previous value when leaving the scope
+// @example: TULogScope stage{&TULogContext::stage, "execute-pre"};
+class TULogScope {
+public:
+    TULogScope(std::string TULogContext::*field, std::string value):
+        field{field}, previous{tulogContext.*field} {
+        tulogContext.*field = std::move(value);
+    }
+    ~TULogScope() {
+        tulogContext.*field = std::move(previous);
+    }
+private:
+    std::string TULogContext::*field;
+    std::string previous;
+};
+
+// Thread safe: Messages are formatted once per call into a thread local buffer and only if
+// at least one output will actually print them; console output is serialized, also
+// across fork().
 class TULog {
 public:
-    TULogLevel level = TULogLevel::Error;
+    std::atomic<TULogLevel> level = TULogLevel::Error;
     TULogOutput output{};
 
     template<typename... T> void error(const T&... args) {
-        if (level >=TULogLevel::Error) {
-            print_to_output(LOG_ERR, args...);
-        }
-        print_to_syslog(LOG_ERR, args...);
+        write(LOG_ERR, level >= TULogLevel::Error, true, {}, args...);
     }
     template<typename... T> void info(const T&... args) {
-        if (level >= TULogLevel::Info) {
-            print_to_output(LOG_INFO, args...);
-        }
-        print_to_syslog(LOG_INFO, args...);
+        write(LOG_INFO, level >= TULogLevel::Info, true, {}, args...);
     }
     template<typename... T> void debug(const T&... args) {
-        if (level >= TULogLevel::Debug) {
-            print_to_output(LOG_DEBUG, args...);
-            print_to_syslog(LOG_DEBUG, args...);
-        }
+        bool enabled = level >= TULogLevel::Debug;
+        write(LOG_DEBUG, enabled, enabled, {}, args...);
     }
 
     template<typename... T> void log(const T&... args) {
-        print_to_output(LOG_INFO, args...);
-        print_to_syslog(LOG_INFO, args...);
+        write(LOG_INFO, true, true, {}, args...);
+    }
+
+    // Info message with additional journal fields ("NAME=value")
+    template<typename... T> void infoFields(const std::vector<std::string>& fields, const T&... args) {
+        write(LOG_INFO, level >= TULogLevel::Info, true, fields, args...);
     }
 
     void setLogOutput(std::string outputs) {
-        output.console = false;
-        output.syslog = false;
+        bool console = false;
+        bool syslog = false;
         std::string field;
         std::stringstream ss(outputs);
         while (getline(ss, field, ',')) {
             if (field == "console") {
-                output.console = true;
+                console = true;
                 continue;
             }
             if (field == "syslog") {
-                output.syslog = true;
+                syslog = true;
                 continue;
             }
             throw std::invalid_argument{"Invalid log output."};
         }
+        output.console = console;
+        output.syslog = syslog;
     }
 
 private:
-    template<typename... T> void print_to_output(int loglevel, const T&... args) {
-        if (output.console) {
-            std::stringstream ss;
-            ((ss << args),...);
-            std::string s = ss.str();
+    inline static std::mutex consoleLock;
+    // Children forked while another thread was writing (e.g. the SELinux relabelling or
+    // command children) would otherwise block forever on their first message
+    inline static const int consoleLockAtfork = pthread_atfork(
+        [] { consoleLock.lock(); }, [] { consoleLock.unlock(); }, [] { consoleLock.unlock(); });
+
+    template<typename... T> void write(int loglevel, bool toConsole, bool toSyslog, const std::vector<std::string>& fields, const T&... args) {
+        toConsole = toConsole && output.console;
+        toSyslog = toSyslog && output.syslog;
+        if (!toConsole && !toSyslog)
+            return;
+
+        thread_local std::ostringstream buffer;
+        buffer.str(std::string{});
+        buffer.clear();
+        ((buffer << args),...);
+        std::string s = buffer.str();
+
+        if (toConsole) {
+            std::lock_guard<std::mutex> lock{consoleLock};
             if (loglevel <= LOG_ERR) {
                 std::cerr << s << std::endl;
             } else {
                 std::cout << s << std::endl;
             }
         }
+        if (toSyslog) {
+            print_to_journal(loglevel, s, fields);
+        }
     }
-    template<typename... T> void print_to_syslog(int loglevel, const T&... args) {
-        if (output.syslog) {
-            std::stringstream ss;
-            ((ss << args),...);
-            std::string s = ss.str();
-            syslog(loglevel, "%s", s.c_str());
+
+    // The journal forwards the messages to syslog, if configured
+    void print_to_journal(int loglevel, const std::string& message, const std::vector<std::string>& extraFields) {
+        std::vector<std::string> fields;
+        fields.push_back("MESSAGE=" + message);
+        fields.push_back("PRIORITY=" + std::to_string(loglevel));
+        fields.push_back(std::string("SYSLOG_IDENTIFIER=") + program_invocation_short_name);
+        if (!tulogContext.transaction.empty())
+            fields.push_back("TRANSACTION_ID=" + tulogContext.transaction);
+        if (!tulogContext.stage.empty())
+            fields.push_back("STAGE=" + tulogContext.stage);
+        if (!tulogContext.plugin.empty())
+            fields.push_back("PLUGIN=" + tulogContext.plugin);
+        fields.insert(fields.end(), extraFields.begin(), extraFields.end());
+        std::vector<struct iovec> iov(fields.size());
+        for (size_t i = 0; i < fields.size(); i++) {
+            iov[i].iov_base = fields[i].data();
+            iov[i].iov_len = fields[i].size();
+        }
+        if (sd_journal_sendv(iov.data(), iov.size()) < 0) {
+            syslog(loglevel, "%s", message.c_str());
         }
     }
 };
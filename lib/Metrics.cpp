@@ -0,0 +1,159 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Metrics about transactions
+ */
+
+#include "Metrics.hpp"
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace TransactionalUpdate {
+
+using namespace std;
+
+struct MetricFamily {
+    const char* name;
+    const char* type;
+    const char* help;
+};
+
+static const MetricFamily families[] = {
+    {"tukit_transactions_total", "counter", "Number of transactions by event (opened, finalized, discarded, aborted)."},
+    {"tukit_phase_duration_seconds", "histogram", "Time spent in the individual phases of transactions."},
+    {"tukit_plugin_failures_total", "counter", "Number of failed plugin calls."},
+    {"tukit_snapshots", "gauge", "Number of snapshots when they were listed last."},
+};
+
+// Upper bounds in seconds; phases range from short mounts to long running package updates
+static const char* buckets[] = {"0.005", "0.05", "0.25", "1", "5", "30", "120", "600", "1800", "+Inf"};
+
+static string sampleName(const string& name, const MetricLabels& labels) {
+    if (labels.empty())
+        return name;
+    string sample = name + "{";
+    for (auto it = labels.begin(); it != labels.end(); ++it) {
+        if (it != labels.begin())
+            sample += ",";
+        sample += it->first + "=\"";
+        for (char c: it->second) {
+            if (c == '\\' || c == '"')
+                sample += '\\';
+            if (c == '\n')
+                sample += "\\n";
+            else
+                sample += c;
+        }
+        sample += "\"";
+    }
+    return sample + "}";
+}
+
+static const MetricFamily* familyOf(const string& sample) {
+    for (auto& family: families) {
+        size_t len = strlen(family.name);
+        if (sample.compare(0, len, family.name) != 0)
+            continue;
+        string suffix = sample.substr(len, sample.find('{') - len);
+        if (suffix.empty() || (strcmp(family.type, "histogram") == 0 &&
+                (suffix == "_bucket" || suffix == "_sum" || suffix == "_count")))
+            return &family;
+    }
+    return nullptr;
+}
+
+void Metrics::increment(const string& name, const MetricLabels& labels) {
+    lock_guard<mutex> guard{lock};
+    samples[sampleName(name, labels)] += 1;
+}
+
+void Metrics::set(const string& name, double value, const MetricLabels& labels) {
+    lock_guard<mutex> guard{lock};
+    samples[sampleName(name, labels)] = value;
+}
+
+void Metrics::observe(const string& name, double value, const MetricLabels& labels) {
+    lock_guard<mutex> guard{lock};
+    for (auto bucket: buckets) {
+        MetricLabels bucketLabels = labels;
+        bucketLabels["le"] = bucket;
+        // Create empty buckets, too
+        double& count = samples[sampleName(name + "_bucket", bucketLabels)];
+        if (strcmp(bucket, "+Inf") == 0 || value <= stod(bucket))
+            count += 1;
+    }
+    samples[sampleName(name + "_sum", labels)] += value;
+    samples[sampleName(name + "_count", labels)] += 1;
+}
+
+string Metrics::format(const map<string, double>& values) {
+    ostringstream out;
+    out << setprecision(15);
+    for (auto& family: families) {
+        bool header = false;
+        for (auto& [sample, value]: values) {
+            if (familyOf(sample) != &family)
+                continue;
+            if (!header) {
+                out << "# HELP " << family.name << " " << family.help << "\n";
+                out << "# TYPE " << family.name << " " << family.type << "\n";
+                header = true;
+            }
+            out << sample << " " << value << "\n";
+        }
+    }
+    return out.str();
+}
+
+string Metrics::format() {
+    lock_guard<mutex> guard{lock};
+    return format(samples);
+}
+
+void Metrics::writeTextfile(const filesystem::path& path) {
+    map<string, double> values;
+    {
+        lock_guard<mutex> guard{lock};
+        values = samples;
+    }
+
+    ifstream previous{path};
+    for (string line; getline(previous, line); ) {
+        size_t pos = line.rfind(' ');
+        if (line.empty() || line[0] == '#' || pos == string::npos)
+            continue;
+        string sample = line.substr(0, pos);
+        const MetricFamily* family = familyOf(sample);
+        if (family == nullptr)
+            continue;
+        double value;
+        try {
+            value = stod(line.substr(pos + 1));
+        } catch (const exception &e) {
+            continue;
+        }
+        if (strcmp(family->type, "gauge") == 0)
+            values.emplace(sample, value);
+        else
+            values[sample] += value;
+    }
+    previous.close();
+
+    filesystem::path tmp = path;
+    tmp += ".tmp." + to_string(getpid());
+    ofstream out{tmp};
+    out << format(values);
+    out.close();
+    if (out.fail()) {
+        filesystem::remove(tmp);
+        throw runtime_error{"Writing metrics to '" + tmp.native() + "' failed."};
+    }
+    filesystem::rename(tmp, path);
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Metrics about transactions (counters, gauges and histograms), accumulated
+  per process and exported in the Prometheus / OpenMetrics text format, e.g.
+  for node_exporter's textfile collector.
+ */
+
+#ifndef T_U_METRICS_H
+#define T_U_METRICS_H
+
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace TransactionalUpdate {
+
+using MetricLabels = std::map<std::string, std::string>;
+
+class Metrics {
+public:
+    void increment(const std::string& name, const MetricLabels& labels = {});
+    void set(const std::string& name, double value, const MetricLabels& labels = {});
+    void observe(const std::string& name, double value, const MetricLabels& labels = {});
+
+    /**
+     * @brief Return all metrics in the text exposition format
+     */
+    std::string format();
+
+    /**
+     * @brief Write the metrics into a textfile
+     * @param path File name; it will be replaced atomically
+     *
+     * Each tukit process only sees its own transactions, so counters and histograms already
+     * contained in the file are added to the values of this process; call it only once per
+     * process.
+     */
+    void writeTextfile(const std::filesystem::path& path);
+private:
+    std::string format(const std::map<std::string, double>& values);
+    std::mutex lock;
+    // Sample name including its labels, e.g. tukit_transactions_total{event="opened"}
+    std::map<std::string, double> samples;
+};
+
+inline Metrics metrics{};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_METRICS_H
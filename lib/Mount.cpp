@@ -7,6 +7,7 @@
 
 #include "Log.hpp"
 #include "Mount.hpp"
+#include "Timing.hpp"
 #include <cstring>
 #include <filesystem>
 #include <stdexcept>
@@ -35,6 +36,7 @@ Mount::~Mount() {
         if ((mnt_table_parse_mtab(umount_table, nullptr)) != 0)
             tulog.error("Error reading mtab for umount");
         struct libmnt_fs* umount_fs = mnt_table_find_target(umount_table,  mnt_fs_get_target(mnt_fs), MNT_ITER_BACKWARD);
+        ScopedTimer timer{"umount", mountpoint};
         umountRecursive(umount_table, umount_fs);
         mnt_free_fs(umount_fs);
         mnt_free_table(umount_table);
@@ -169,6 +171,7 @@ void Mount::setType(std::string type) {
 
 void Mount::mount(std::filesystem::path prefix) {
     tulog.debug("Mounting ", mountpoint, "...");
+    ScopedTimer timer{"mount", mountpoint};
 
     int rc;
     std::filesystem::path mounttarget = prefix / mountpoint.relative_path();
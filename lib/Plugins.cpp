@@ -5,7 +5,9 @@
 
 #include "Exceptions.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 #include "Plugins.hpp"
+#include "Timing.hpp"
 #include "Util.hpp"
 #include <regex>
 #include <set>
@@ -58,8 +60,11 @@ Plugins::~Plugins() {
 
 void Plugins::run(string stage, string args) {
     std::string output;
+    TULogScope stageScope{&TULogContext::stage, stage};
 
     for (auto& p: plugins) {
+        TULogScope pluginScope{&TULogContext::plugin, p.filename()};
+        ScopedTimer timer{"plugin", stage + " " + p.filename().string()};
         std::string cmd = p.string() + " " + stage;
         if (!args.empty())
             cmd.append(" " + args);
@@ -70,6 +75,7 @@ void Plugins::run(string stage, string args) {
                 tulog.info("Output of plugin ", p, ":\n", output, "---");
         } catch (const ExecutionException &e) {
             tulog.error("ERROR: ", e.what());
+            metrics.increment("tukit_plugin_failures_total", {{"stage", stage}, {"plugin", p.filename().string()}});
             if (!e.output.empty())
                 tulog.error("Output of plugin ", p, ":\n", e.output, "---");
             if (!ignore_error)
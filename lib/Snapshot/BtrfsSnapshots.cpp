@@ -0,0 +1,235 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Snapshot backend using plain btrfs subvolumes without snapper
+ */
+
+#include "BtrfsSnapshots.hpp"
+#include "Btrfs.hpp"
+#include "Configuration.hpp"
+#include "EtcSubvolume.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "SnapshotIndex.hpp"
+#include "Timing.hpp"
+#include <set>
+#include <stdexcept>
+
+namespace TransactionalUpdate {
+
+static const std::filesystem::path snapshotDir{"/.snapshots"};
+
+/* SnapshotManager methods */
+
+std::unique_ptr<Snapshot> BtrfsSnapshots::create(std::string base, std::string description) {
+    if (! std::filesystem::exists(snapshotDir / base / "snapshot"))
+        throw std::invalid_argument{"Base snapshot '" + base + "' does not exist."};
+    ScopedTimer timer{"btrfs", "create"};
+    {
+        SnapshotIndex index{snapshotDir, true};
+        unsigned long id = index.nextId();
+        snapshotId = std::to_string(id);
+
+        std::filesystem::create_directory(snapshotDir / snapshotId);
+        try {
+            Btrfs::createSnapshot(snapshotDir / base / "snapshot", getRoot());
+        } catch (...) {
+            std::filesystem::remove(snapshotDir / snapshotId);
+            throw;
+        }
+
+        SnapshotIndex::Entry& entry = index.entries[id];
+        entry.parent = base;
+        entry.date = SnapshotIndex::getDate();
+        entry.cleanup = "number";
+        entry.description = description;
+        entry.userdata["transactional-update-in-progress"] = "yes";
+        index.write();
+    }
+
+    // What snapper's 50-etc plugin would do otherwise; the /etc overlay migration isn't
+    // supported here
+    try {
+        EtcSubvolume{snapshotId}.create();
+    } catch (const std::exception &e) {
+        tulog.error("ERROR: Creating /etc subvolume of snapshot ", snapshotId, " failed: ", e.what());
+        deleteSnap(snapshotId);
+        throw;
+    }
+    return std::make_unique<BtrfsSnapshots>(snapshotId);
+}
+
+std::unique_ptr<Snapshot> BtrfsSnapshots::open(std::string id) {
+    snapshotId = id;
+    if (! std::filesystem::exists(getRoot()))
+        throw std::invalid_argument{"Snapshot " + id + " does not exist."};
+    return std::make_unique<BtrfsSnapshots>(snapshotId);
+}
+
+std::deque<std::map<std::string, std::string>> BtrfsSnapshots::getList(std::string columns) {
+    std::string defaultSnap;
+    std::string current;
+    try {
+        defaultSnap = getDefault();
+        current = getCurrent();
+    } catch (const std::exception &e) {
+        tulog.debug("Couldn't determine default or current snapshot: ", e.what());
+    }
+
+    SnapshotIndex index{snapshotDir};
+    auto snapshotList = index.getList(columns, [&](const std::string& id, const std::string& column) {
+        if (column == "default")
+            return std::string(id == defaultSnap ? "yes" : "no");
+        else if (column == "active")
+            return std::string(id == current ? "yes" : "no");
+        else if (column == "read-only")
+            return std::string(Btrfs::isReadOnly(snapshotDir / id / "snapshot") ? "yes" : "no");
+        else if (column == "subvolume")
+            return (snapshotDir / id / "snapshot").native();
+        throw std::invalid_argument{"Unsupported column '" + column + "'."};
+    });
+    metrics.set("tukit_snapshots", snapshotList.size());
+    return snapshotList;
+}
+
+void BtrfsSnapshots::deleteSnap(std::string id) {
+    deleteSnaps({id});
+}
+
+void BtrfsSnapshots::deleteSnaps(std::vector<std::string> ids) {
+    if (ids.empty())
+        return;
+    joinIds(ids);
+    std::set<std::string> inUse;
+    try {
+        inUse.insert(getDefault());
+        inUse.insert(getCurrent());
+    } catch (const std::exception &e) {
+        tulog.debug("Couldn't determine default or current snapshot: ", e.what());
+    }
+    for (auto& id: ids) {
+        if (inUse.count(id))
+            throw std::invalid_argument{"Snapshot " + id + " is in use and cannot be deleted."};
+    }
+
+    ScopedTimer timer{"btrfs", "delete"};
+    SnapshotIndex index{snapshotDir, true};
+    try {
+        for (auto& id: ids) {
+            std::filesystem::path root = snapshotDir / id / "snapshot";
+            if (!index.entries.count(std::stoul(id)) && !std::filesystem::exists(root))
+                throw std::invalid_argument{"Snapshot " + id + " does not exist."};
+            if (Btrfs::isSubvolume(root)) {
+                EtcSubvolume{id}.remove();
+                Btrfs::deleteSubvolume(root);
+            }
+            std::filesystem::remove_all(snapshotDir / id);
+            index.entries.erase(std::stoul(id));
+        }
+    } catch (...) {
+        index.write();
+        throw;
+    }
+    index.write();
+}
+
+void BtrfsSnapshots::modifySnaps(std::vector<std::string> ids, std::optional<std::string> cleanupAlgorithm, std::optional<std::string> userdata) {
+    if (ids.empty() || (!cleanupAlgorithm && !userdata))
+        return;
+    SnapshotIndex index{snapshotDir, true};
+    for (auto& id: ids) {
+        SnapshotIndex::Entry& entry = index.at(id);
+        if (cleanupAlgorithm)
+            entry.cleanup = *cleanupAlgorithm;
+        if (userdata)
+            SnapshotIndex::parseUserdata(*userdata, entry.userdata);
+    }
+    index.write();
+}
+
+void BtrfsSnapshots::rollbackTo(std::string id) {
+    joinIds({id});
+    std::filesystem::path root = snapshotDir / id / "snapshot";
+    if (!Btrfs::isSubvolume(root))
+        throw std::invalid_argument{"Snapshot " + id + " does not exist."};
+    Btrfs::setDefaultSubvolume(root);
+}
+
+CleanupState BtrfsSnapshots::cleanup(CleanupState state, bool important) {
+    // Without snapper nobody else runs the "number" cleanup algorithm, so do it right here:
+    // Keep the newest SNAPSHOT_NUMBER_LIMIT snapshots, important ones are counted separately.
+    unsigned long limit;
+    try {
+        std::string value = config.get("SNAPSHOT_NUMBER_LIMIT");
+        // std::stoul would silently wrap negative numbers
+        if (value.find('-') != std::string::npos)
+            throw std::out_of_range{value};
+        limit = std::stoul(value);
+    } catch (const std::logic_error &e) {
+        throw std::invalid_argument{"Invalid value for SNAPSHOT_NUMBER_LIMIT: '" + config.get("SNAPSHOT_NUMBER_LIMIT") + "'"};
+    }
+
+    CleanupState remaining = Snapper::cleanup(state, important);
+    std::set<std::string> keep{getCurrent(), getBooted(), getDefault()};
+    std::vector<std::string> regular;
+    std::vector<std::string> importantSnaps;
+    {
+        SnapshotIndex index{snapshotDir};
+        for (auto it = index.entries.rbegin(); it != index.entries.rend(); it++) {
+            std::string number = std::to_string(it->first);
+            if (it->second.cleanup != "number" || keep.count(number))
+                continue;
+            auto imp = it->second.userdata.find("important");
+            if (imp != it->second.userdata.end() && imp->second == "yes")
+                importantSnaps.push_back(number);
+            else
+                regular.push_back(number);
+        }
+    }
+    std::vector<std::string> obsolete;
+    for (auto list: {&regular, &importantSnaps}) {
+        if (list->size() > limit)
+            obsolete.insert(obsolete.end(), list->begin() + limit, list->end());
+    }
+    if (!obsolete.empty()) {
+        tulog.info("Deleting obsolete snapshots ", joinIds(obsolete));
+        try {
+            deleteSnaps(obsolete);
+        } catch (const std::exception &e) {
+            tulog.error("ERROR: Cannot delete snapshots: ", e.what());
+        }
+    }
+    return remaining;
+}
+
+/* Snapshot methods */
+
+void BtrfsSnapshots::close() {
+    modifySnaps({snapshotId}, std::nullopt, "transactional-update-in-progress=");
+}
+
+void BtrfsSnapshots::abort() {
+    deleteSnap(snapshotId);
+}
+
+bool BtrfsSnapshots::isInProgress() {
+    SnapshotIndex index{snapshotDir};
+    try {
+        SnapshotIndex::Entry& entry = index.at(snapshotId);
+        auto it = entry.userdata.find("transactional-update-in-progress");
+        return it != entry.userdata.end() && it->second == "yes";
+    } catch (const std::invalid_argument &e) {
+        return false;
+    }
+}
+
+void BtrfsSnapshots::setDefault() {
+    Btrfs::setDefaultSubvolume(getRoot());
+}
+
+void BtrfsSnapshots::setReadOnly(bool readonly) {
+    Btrfs::setReadOnly(getRoot(), readonly);
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Snapshot backend using plain btrfs subvolumes without snapper; the snapshots
+  use the same /.snapshots/<id>/snapshot layout, their metadata is kept in the
+  index file /.snapshots/tukit.index.
+ */
+
+#ifndef T_U_BTRFSSNAPSHOTS_H
+#define T_U_BTRFSSNAPSHOTS_H
+
+#include "Snapper.hpp"
+
+namespace TransactionalUpdate {
+
+class BtrfsSnapshots: public Snapper {
+public:
+    ~BtrfsSnapshots() = default;
+
+    // Snapshot
+    BtrfsSnapshots(std::string snap): Snapper(snap) {};
+    void close() override;
+    void abort() override;
+    bool isInProgress() override;
+    void setDefault() override;
+    void setReadOnly(bool readonly) override;
+
+    // SnapshotManager
+    BtrfsSnapshots(): Snapper("") {};
+    std::unique_ptr<Snapshot> create(std::string base, std::string description) override;
+    std::unique_ptr<Snapshot> open(std::string id) override;
+    std::deque<std::map<std::string, std::string>> getList(std::string columns) override;
+    void deleteSnap(std::string id) override;
+    void deleteSnaps(std::vector<std::string> ids) override;
+    void modifySnaps(std::vector<std::string> ids, std::optional<std::string> cleanupAlgorithm, std::optional<std::string> userdata = std::nullopt) override;
+    void rollbackTo(std::string id) override;
+    CleanupState cleanup(CleanupState state, bool important) override;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_BTRFSSNAPSHOTS_H
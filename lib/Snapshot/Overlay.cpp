@@ -0,0 +1,296 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Overlayfs backend for snapshot handling
+ */
+
+#include "Overlay.hpp"
+#include "Configuration.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "SnapshotIndex.hpp"
+#include "Timing.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <stdexcept>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+namespace TransactionalUpdate {
+
+static void checkId(const std::string& id) {
+    if (id.empty() || id.find_first_not_of("0123456789") != std::string::npos)
+        throw std::invalid_argument{"Invalid snapshot ID '" + id + "'."};
+}
+
+static bool isMountPoint(const std::filesystem::path& path) {
+    struct stat st;
+    struct stat parent;
+    if (stat(path.c_str(), &st) < 0 || stat((path / "..").c_str(), &parent) < 0)
+        return false;
+    return st.st_dev != parent.st_dev;
+}
+
+std::filesystem::path Overlay::getDir() {
+    std::filesystem::path dir = config.get("OVERLAY_DIR");
+    std::filesystem::create_directories(dir);
+    return dir;
+}
+
+// The upper directory of the snapshot is stacked on top of the ones of all its ancestors
+void Overlay::mountSnapshot(SnapshotIndex& index) {
+    std::filesystem::path root = getRoot();
+    if (isMountPoint(root))
+        return;
+
+    std::string lowerDirs;
+    std::set<std::string> seen;
+    for (std::string parent = index.at(snapshotId).parent; parent != "0"; parent = index.at(parent).parent) {
+        if (!seen.insert(parent).second)
+            throw std::runtime_error{"Loop in the ancestors of snapshot " + snapshotId + "."};
+        lowerDirs += (getDir() / parent / "upper").native() + ":";
+    }
+    lowerDirs += Overlay{"0"}.getRoot().native();
+
+    std::string options = "lowerdir=" + lowerDirs + ",upperdir=" + (getDir() / snapshotId / "upper").native() +
+        ",workdir=" + (getDir() / snapshotId / "work").native();
+    tulog.debug("Mounting overlay ", root, " with options ", options);
+    ScopedTimer timer{"mount", root};
+    if (::mount("overlay", root.c_str(), "overlay", 0, options.c_str()) < 0)
+        throw std::runtime_error{"Mounting overlay for snapshot " + snapshotId + " failed: " + std::string(strerror(errno))};
+    mountedRoot = root;
+}
+
+Overlay::~Overlay() {
+    if (!mountedRoot.empty() && umount2(mountedRoot.c_str(), MNT_DETACH) < 0 && errno != EINVAL)
+        tulog.error("Unmounting overlay ", mountedRoot, " failed: ", strerror(errno));
+}
+
+/* SnapshotManager methods */
+
+std::unique_ptr<Snapshot> Overlay::create(std::string base, std::string description) {
+    ScopedTimer timer{"overlay", "create"};
+    SnapshotIndex index{getDir(), true};
+    if (base == "0") {
+        if (!std::filesystem::is_directory(Overlay{"0"}.getRoot()))
+            throw std::invalid_argument{"Base tree '" + Overlay{"0"}.getRoot().native() + "' does not exist."};
+    } else {
+        index.at(base);
+    }
+
+    unsigned long id = index.nextId();
+    snapshotId = std::to_string(id);
+    auto snapshot = std::make_unique<Overlay>(snapshotId);
+    SnapshotIndex::Entry& entry = index.entries[id];
+    entry.parent = base;
+    entry.date = SnapshotIndex::getDate();
+    entry.cleanup = "number";
+    entry.description = description;
+    entry.userdata["transactional-update-in-progress"] = "yes";
+
+    try {
+        std::filesystem::create_directories(getDir() / snapshotId / "upper");
+        std::filesystem::create_directories(getDir() / snapshotId / "work");
+        std::filesystem::create_directories(getRoot());
+        snapshot->mountSnapshot(index);
+        index.write();
+    } catch (...) {
+        snapshot.reset();
+        std::filesystem::remove_all(getDir() / snapshotId);
+        throw;
+    }
+    return snapshot;
+}
+
+std::unique_ptr<Snapshot> Overlay::open(std::string id) {
+    checkId(id);
+    if (id == "0")
+        throw std::invalid_argument{"Snapshot 0 is the base tree and cannot be opened."};
+    snapshotId = id;
+    SnapshotIndex index{getDir()};
+    index.at(id);
+    auto snapshot = std::make_unique<Overlay>(snapshotId);
+    snapshot->mountSnapshot(index);
+    return snapshot;
+}
+
+std::deque<std::map<std::string, std::string>> Overlay::getList(std::string columns) {
+    std::string defaultSnap = getDefault();
+    std::string current = getCurrent();
+
+    SnapshotIndex index{getDir()};
+    auto snapshotList = index.getList(columns, [&](const std::string& id, const std::string& column) {
+        if (column == "default")
+            return std::string(id == defaultSnap ? "yes" : "no");
+        else if (column == "active")
+            return std::string(id == current ? "yes" : "no");
+        else if (column == "read-only")
+            return std::string(Overlay{id}.isReadOnly() ? "yes" : "no");
+        else if (column == "subvolume")
+            return Overlay{id}.getRoot().native();
+        throw std::invalid_argument{"Unsupported column '" + column + "'."};
+    });
+    metrics.set("tukit_snapshots", snapshotList.size());
+    return snapshotList;
+}
+
+// The running system is never one of the snapshots
+std::string Overlay::getCurrent() {
+    return "0";
+}
+
+std::string Overlay::getDefault() {
+    std::error_code ec;
+    std::filesystem::path target = std::filesystem::read_symlink(getDir() / "default", ec);
+    if (ec)
+        return "0";
+    return target.native();
+}
+
+void Overlay::deleteSnap(std::string id) {
+    deleteSnaps({id});
+}
+
+void Overlay::deleteSnaps(std::vector<std::string> ids) {
+    if (ids.empty())
+        return;
+    std::string defaultSnap = getDefault();
+    SnapshotIndex index{getDir(), true};
+    std::set<std::string> deleted;
+    for (auto& id: ids) {
+        checkId(id);
+        index.at(id);
+        if (id == defaultSnap)
+            throw std::invalid_argument{"Snapshot " + id + " is the default snapshot and cannot be deleted."};
+        deleted.insert(id);
+    }
+    // The upper directory is still needed by snapshots based on it
+    for (auto& [id, entry]: index.entries) {
+        if (deleted.count(entry.parent) && !deleted.count(std::to_string(id)))
+            throw std::invalid_argument{"Snapshot " + entry.parent + " is the base of snapshot " + std::to_string(id) + " and cannot be deleted."};
+    }
+
+    ScopedTimer timer{"overlay", "delete"};
+    std::vector<std::string> sorted{ids.begin(), ids.end()};
+    std::sort(sorted.begin(), sorted.end(), [](const std::string& a, const std::string& b) {
+        return std::stoul(a) > std::stoul(b);
+    });
+    try {
+        for (auto& id: sorted) {
+            std::filesystem::path root = Overlay{id}.getRoot();
+            if (isMountPoint(root) && umount2(root.c_str(), MNT_DETACH) < 0)
+                throw std::runtime_error{"Unmounting snapshot " + id + " failed: " + std::string(strerror(errno))};
+            std::filesystem::remove_all(getDir() / id);
+            index.entries.erase(std::stoul(id));
+        }
+    } catch (...) {
+        index.write();
+        throw;
+    }
+    index.write();
+}
+
+void Overlay::modifySnaps(std::vector<std::string> ids, std::optional<std::string> cleanupAlgorithm, std::optional<std::string> userdata) {
+    if (ids.empty() || (!cleanupAlgorithm && !userdata))
+        return;
+    SnapshotIndex index{getDir(), true};
+    for (auto& id: ids) {
+        SnapshotIndex::Entry& entry = index.at(id);
+        if (cleanupAlgorithm)
+            entry.cleanup = *cleanupAlgorithm;
+        if (userdata)
+            SnapshotIndex::parseUserdata(*userdata, entry.userdata);
+    }
+    index.write();
+}
+
+void Overlay::rollbackTo(std::string id) {
+    checkId(id);
+    if (id != "0")
+        SnapshotIndex{getDir()}.at(id);
+    std::filesystem::path link = getDir() / "default";
+    std::filesystem::path tmp = getDir() / "default.new";
+    std::filesystem::remove(tmp);
+    std::filesystem::create_symlink(id, tmp);
+    std::filesystem::rename(tmp, link);
+}
+
+// Nothing is removed automatically; the snapshots just get the "number" cleanup algorithm
+CleanupState Overlay::cleanup(CleanupState state, bool important) {
+    CleanupState remaining;
+    std::string defaultSnap = getDefault();
+    SnapshotIndex index{getDir(), true};
+
+    std::vector<std::string> unused = state.unused;
+    for (auto& [id, entry]: index.entries) {
+        if (entry.userdata.count("transactional-update-in-progress"))
+            unused.push_back(std::to_string(id));
+    }
+    for (auto& snap: state.previous) {
+        if (snap == defaultSnap || snap == "0" || !index.entries.count(std::stoul(snap)))
+            continue;
+        index.at(snap).cleanup = "number";
+        if (important)
+            index.at(snap).userdata["important"] = "yes";
+    }
+    for (auto& snap: unused) {
+        if (snap == defaultSnap)
+            remaining.unused.push_back(snap);
+        else if (snap != "0" && index.entries.count(std::stoul(snap)))
+            index.at(snap).cleanup = "number";
+    }
+    index.write();
+    return remaining;
+}
+
+/* Snapshot methods */
+
+void Overlay::close() {
+    modifySnaps({snapshotId}, std::nullopt, "transactional-update-in-progress=");
+}
+
+void Overlay::abort() {
+    deleteSnap(snapshotId);
+    mountedRoot.clear();
+}
+
+std::filesystem::path Overlay::getRoot() {
+    if (snapshotId == "0") {
+        std::string base = config.get("OVERLAY_BASE");
+        return base.empty() ? getDir() / "0" / "snapshot" : std::filesystem::path{base};
+    }
+    return getDir() / snapshotId / "snapshot";
+}
+
+bool Overlay::isInProgress() {
+    SnapshotIndex index{getDir()};
+    try {
+        auto& userdata = index.at(snapshotId).userdata;
+        auto it = userdata.find("transactional-update-in-progress");
+        return it != userdata.end() && it->second == "yes";
+    } catch (const std::invalid_argument &e) {
+        return false;
+    }
+}
+
+// The read-only state is only recorded, the upper directory stays writable
+bool Overlay::isReadOnly() {
+    return snapshotId == "0" || std::filesystem::exists(getDir() / snapshotId / "read-only");
+}
+
+void Overlay::setDefault() {
+    rollbackTo(snapshotId);
+}
+
+void Overlay::setReadOnly(bool readonly) {
+    if (readonly)
+        std::ofstream{getDir() / snapshotId / "read-only"};
+    else
+        std::filesystem::remove(getDir() / snapshotId / "read-only");
+}
+
+} // namespace TransactionalUpdate
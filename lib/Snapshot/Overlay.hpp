@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Overlayfs backend for snapshot handling, e.g. for tests and CI systems
+  without btrfs: Every snapshot is an upper directory stacked on top of its
+  ancestors and a base tree (snapshot "0"); the metadata is stored in a
+  SnapshotIndex. Works in unprivileged user namespaces. The overlay is only
+  mounted as long as the snapshot object returned by create() / open() exists.
+ */
+
+#ifndef T_U_OVERLAY_H
+#define T_U_OVERLAY_H
+
+#include "SnapshotManager.hpp"
+#include "Snapshot.hpp"
+#include <filesystem>
+#include <string>
+
+namespace TransactionalUpdate {
+
+class SnapshotIndex;
+
+class Overlay: public SnapshotManager, public Snapshot {
+public:
+    ~Overlay();
+
+    // Snapshot
+    Overlay(std::string snap): Snapshot(snap) {};
+    void close() override;
+    void abort() override;
+    std::filesystem::path getRoot() override;
+    bool isInProgress() override;
+    bool isReadOnly() override;
+    void setDefault() override;
+    void setReadOnly(bool readonly) override;
+
+    // SnapshotManager
+    Overlay(): Snapshot("") {};
+    std::unique_ptr<Snapshot> create(std::string base, std::string description) override;
+    std::unique_ptr<Snapshot> open(std::string id) override;
+    std::deque<std::map<std::string, std::string>> getList(std::string columns) override;
+    std::string getCurrent() override;
+    std::string getDefault() override;
+    void deleteSnap(std::string id) override;
+    void deleteSnaps(std::vector<std::string> ids) override;
+    void modifySnaps(std::vector<std::string> ids, std::optional<std::string> cleanupAlgorithm, std::optional<std::string> userdata = std::nullopt) override;
+    void rollbackTo(std::string id) override;
+    CleanupState cleanup(CleanupState state, bool important) override;
+private:
+    std::filesystem::path getDir();
+    void mountSnapshot(SnapshotIndex& index);
+    // Set if this object mounted the overlay and has to unmount it again
+    std::filesystem::path mountedRoot;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_OVERLAY_H
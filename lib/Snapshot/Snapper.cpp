@@ -6,9 +6,21 @@
  */
 
 #include "Snapper.hpp"
+#include "Btrfs.hpp"
 #include "Exceptions.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "SnapperInfo.hpp"
+#include "Timing.hpp"
 #include "Util.hpp"
+#include <fcntl.h>
+#include <fstream>
+#include <libmount/libmount.h>
+#include <mutex>
+#include <poll.h>
 #include <regex>
+#include <set>
+#include <unistd.h>
 
 namespace TransactionalUpdate {
 
@@ -86,6 +98,7 @@ std::deque<std::map<std::string, std::string>> Snapper::getList(std::string colu
         }
         snapshotList.push_back(snapshot);
     }
+    metrics.set("tukit_snapshots", snapshotList.size());
     return snapshotList;
 }
 
@@ -103,61 +116,218 @@ std::filesystem::path Snapper::getRoot() {
     return std::filesystem::path("/.snapshots/" + snapshotId + "/snapshot");
 }
 
-std::string Snapper::getCurrent() {
+// Snapshot number of the btrfs file system mounted at the mount point containing target
+static std::string getMountedSnapshot(struct libmnt_table* table, const char* target) {
+    static const std::regex snapshotRoot{".*.snapshots/(.*)/snapshot.*"};
+    struct libmnt_fs* fs = mnt_table_find_mountpoint(table, target, MNT_ITER_BACKWARD);
+    if (fs == nullptr || mnt_fs_match_fstype(fs, "btrfs") != 1 || mnt_fs_get_root(fs) == nullptr)
+        return "";
+    std::string root = mnt_fs_get_root(fs);
     std::smatch match;
+    if (!std::regex_search(root, match, snapshotRoot))
+        return "";
+    return match[1].str();
+}
 
-    // snapper doesn't support the `apply` command for now, so use findmnt directly.
-    std::string id = Util::exec("findmnt --target /usr --raw --noheadings --output FSROOT --first-only --direction backward --types btrfs");
-    bool found = std::regex_search(id, match, std::regex(".*.snapshots/(.*)/snapshot.*"));
-    if (!found) {
-        id = Util::exec("findmnt --target / --raw --noheadings --output FSROOT --first-only --direction backward --types btrfs");
-        found = std::regex_search(id, match, std::regex(".*.snapshots/(.*)/snapshot.*"));
-        if (!found)
-            throw std::runtime_error{"Couldn't determine current snapshot number"};
+std::string Snapper::getCurrent() {
+    // The result is cached for the whole process; mountinfo signals POLLPRI when the mount
+    // table has changed in the meantime (e.g. after `transactional-update apply`).
+    static std::mutex currentLock;
+    static int mountinfoFd = -1;
+    static std::string current;
+    std::lock_guard<std::mutex> lock{currentLock};
+
+    if (mountinfoFd < 0) {
+        mountinfoFd = ::open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    } else if (!current.empty()) {
+        struct pollfd pfd = {mountinfoFd, POLLPRI, 0};
+        if (poll(&pfd, 1, 0) == 0)
+            return current;
     }
-    return match[1].str();
+
+    // snapper doesn't support the `apply` command for now, so use the mount table directly.
+    ScopedTimer timer{"current-snapshot"};
+    struct libmnt_table* table = mnt_new_table();
+    int rc = mnt_table_parse_file(table, "/proc/self/mountinfo");
+    std::string id;
+    if (rc == 0) {
+        id = getMountedSnapshot(table, "/usr");
+        if (id.empty())
+            id = getMountedSnapshot(table, "/");
+    }
+    mnt_unref_table(table);
+    if (rc != 0)
+        throw std::runtime_error{"Error reading mountinfo: " + std::to_string(rc)};
+    if (id.empty())
+        throw std::runtime_error{"Couldn't determine current snapshot number"};
+    current = id;
+    return current;
 }
 
+// snapper's "default" column is just the btrfs default subvolume, so query it directly
 std::string Snapper::getDefault() {
-    std::string id = callSnapper("--csvout list --columns default,number");
+    static const std::regex snapshotPath{"(^|/)\\.snapshots/([0-9]+)/snapshot$"};
+    std::string path = Btrfs::getSubvolumePath("/", Btrfs::getDefaultSubvolume("/")).native();
     std::smatch match;
-    bool found = std::regex_search(id, match, std::regex("yes,([0-9]+)"));
-    if (!found)
+    if (!std::regex_search(path, match, snapshotPath))
         throw std::runtime_error{"Couldn't determine default snapshot number"};
-    return match[1].str();
+    return match[2].str();
 }
 
 void Snapper::deleteSnap(std::string id) {
     callSnapper("delete " + id);
 }
 
+void Snapper::deleteSnaps(std::vector<std::string> ids) {
+    if (ids.empty())
+        return;
+    callSnapper("delete " + joinIds(ids));
+}
+
+void Snapper::modifySnaps(std::vector<std::string> ids, std::optional<std::string> cleanupAlgorithm, std::optional<std::string> userdata) {
+    if (ids.empty() || (!cleanupAlgorithm && !userdata))
+        return;
+    std::string opts = "modify";
+    if (cleanupAlgorithm) {
+        if (cleanupAlgorithm->find('\'') != std::string::npos)
+            throw std::invalid_argument{"Invalid cleanup algorithm '" + *cleanupAlgorithm + "'."};
+        opts += " --cleanup-algorithm '" + *cleanupAlgorithm + "'";
+    }
+    if (userdata) {
+        if (userdata->find('\'') != std::string::npos)
+            throw std::invalid_argument{"Invalid userdata '" + *userdata + "'."};
+        opts += " --userdata '" + *userdata + "'";
+    }
+    callSnapper(opts + " " + joinIds(ids));
+}
+
 void Snapper::rollbackTo(std::string id) {
     callSnapper("rollback " + id);
 }
 
-bool Snapper::isInProgress() {
-    std::string desc = callSnapper("--csvout list --columns number,userdata");
+// The snapshot the system was booted from; it may differ from getCurrent() after 'apply'
+std::string Snapper::getBooted() {
+    std::ifstream mounts{"/proc/mounts"};
     std::smatch match;
-    return std::regex_search(desc, match, std::regex("(^|\n)" + snapshotId + ",.*transactional-update-in-progress=yes"));
+    // With or without the "@" subvolume prefix
+    std::regex rootfs{"^\\S+ / btrfs \\S*subvol=(\\S*/)?\\.snapshots/([0-9]+)/snapshot[,\\s]"};
+    for (std::string line; std::getline(mounts, line); ) {
+        if (std::regex_search(line, match, rootfs))
+            return match[2].str();
+    }
+    return "";
 }
 
-bool Snapper::isReadOnly() {
-    std::string ro = callSnapper("--csvout list --columns number,read-only");
-    std::smatch match;
-    bool found = std::regex_search(ro, match, std::regex(snapshotId + ",(.*)"));
-    if (!found)
-        throw std::runtime_error{"Couldn't determine read-only state"};
-    if (match[1].str() == "yes")
-        return true;
-    else
+static std::string joinList(const std::vector<std::string>& ids) {
+    std::string joined;
+    for (auto& id: ids)
+        joined += (joined.empty() ? "#" : ", #") + id;
+    return joined;
+}
+
+CleanupState Snapper::cleanup(CleanupState state, bool important) {
+    CleanupState remaining;
+    std::string current = getCurrent();
+    std::string booted = getBooted();
+    std::string defaultSnap = getDefault();
+
+    // A single listing is used for all existence and state checks
+    std::set<std::string> existing;
+    std::vector<std::string> unused = state.unused;
+    for (auto& snap: getList("number,userdata")) {
+        existing.insert(snap["number"]);
+        if (snap["userdata"].find("transactional-update-in-progress=yes") != std::string::npos)
+            unused.push_back(snap["number"]);
+    }
+
+    // Previous snapshots are needed as long as they are in use (e.g. for health-checker
+    // rollbacks)
+    std::vector<std::string> markPrevious;
+    std::set<std::string> seen;
+    for (auto& snap: state.previous) {
+        if (!seen.insert(snap).second)
+            continue;
+        if (snap == current || snap == booted)
+            remaining.previous.push_back(snap);
+        else if (existing.count(snap))
+            markPrevious.push_back(snap);
+        else
+            tulog.info("Snapshot #", snap, " doesn't exist anymore.");
+    }
+
+    // A new default snapshot has to be kept in the list, otherwise it would never be cleaned up
+    std::vector<std::string> markUnused;
+    seen.clear();
+    for (auto& snap: unused) {
+        if (!seen.insert(snap).second || snap == current || snap == booted)
+            continue;
+        if (snap == defaultSnap)
+            remaining.unused.push_back(snap);
+        else if (existing.count(snap))
+            markUnused.push_back(snap);
+    }
+
+    // All snapshots are modified at once; if that fails, a single broken snapshot must not
+    // keep the others from being marked, so retry them one by one. Returns the failed ones.
+    auto mark = [&](const std::vector<std::string>& ids, std::optional<std::string> userdata) {
+        std::vector<std::string> failed;
+        try {
+            modifySnaps(ids, "number", userdata);
+            return failed;
+        } catch (const std::exception &e) {
+            if (ids.size() == 1) {
+                tulog.error("ERROR: Cannot set cleanup algorithm for snapshot #", ids[0], ": ", e.what());
+                return ids;
+            }
+            tulog.debug("Setting cleanup algorithm for snapshots ", joinList(ids), " failed: ", e.what());
+        }
+        for (auto& id: ids) {
+            try {
+                modifySnaps({id}, "number", userdata);
+            } catch (const std::exception &e) {
+                tulog.error("ERROR: Cannot set cleanup algorithm for snapshot #", id, ": ", e.what());
+                failed.push_back(id);
+            }
+        }
+        return failed;
+    };
+
+    if (!markPrevious.empty()) {
+        tulog.info("Adding cleanup algorithm", important ? " and \"important=yes\"" : "", " to snapshots ", joinList(markPrevious));
+        mark(markPrevious, important ? std::optional<std::string>{"important=yes"} : std::nullopt);
+    }
+    if (!markUnused.empty()) {
+        tulog.info("Marking unused snapshots ", joinList(markUnused), " for deletion");
+        // Try the failed ones again next time
+        for (auto& id: mark(markUnused, std::nullopt))
+            remaining.unused.push_back(id);
+    }
+
+    return remaining;
+}
+
+bool Snapper::isInProgress() {
+    std::filesystem::path info = "/.snapshots/" + snapshotId + "/info.xml";
+    if (!std::filesystem::exists(info))
         return false;
+    return SnapperInfo{info}.getUserdata("transactional-update-in-progress") == "yes";
+}
+
+bool Snapper::isReadOnly() {
+    try {
+        return Btrfs::isReadOnly(getRoot());
+    } catch (const std::exception &e) {
+        throw std::runtime_error{"Couldn't determine read-only state: " + std::string(e.what())};
+    }
 }
 
+// Changes are still done via snapper if possible to keep the state cached by snapperd and
+// snapper's plugins informed
 void Snapper::setDefault() {
     try {
         callSnapper("modify --default " + snapshotId + " 2>&1");
     } catch (const VersionException &e) {
-        Util::exec("btrfs subvolume set-default " + std::string(getRoot()));
+        Btrfs::setDefaultSubvolume(getRoot());
     }
 }
 
@@ -168,14 +338,32 @@ void Snapper::setReadOnly(bool readonly) {
         else
             callSnapper("modify --read-write " + snapshotId + " 2>&1");
     } catch (const VersionException &e) {
-        Util::exec("btrfs property set " + std::string(getRoot()) + " ro " + (readonly ? "true" : "false"));
+        Btrfs::setReadOnly(getRoot(), readonly);
     }
 }
 
 /* Helper methods */
 
+// The IDs are passed to the shell, so only accept snapshot numbers
+std::string Snapper::joinIds(const std::vector<std::string>& ids) {
+    std::string joined;
+    for (auto& id: ids) {
+        if (id.empty() || id.find_first_not_of("0123456789") != std::string::npos)
+            throw std::invalid_argument{"Invalid snapshot ID '" + id + "'."};
+        if (!joined.empty())
+            joined += " ";
+        joined += id;
+    }
+    return joined;
+}
+
 std::string Snapper::callSnapper(std::string opts) {
     std::string output;
+    // Record the snapper command without its global options and arguments
+    std::string command;
+    std::istringstream optsStream{opts};
+    while (optsStream >> command && command[0] == '-');
+    ScopedTimer timer{"snapper", command};
     try {
         if (std::filesystem::exists("/run/dbus/system_bus_socket")) {
             output = Util::exec("snapper " + opts);
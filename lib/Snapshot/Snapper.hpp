@@ -37,7 +37,13 @@ public:
     std::string getCurrent() override;
     std::string getDefault() override;
     void deleteSnap(std::string id) override;
+    void deleteSnaps(std::vector<std::string> ids) override;
+    void modifySnaps(std::vector<std::string> ids, std::optional<std::string> cleanupAlgorithm, std::optional<std::string> userdata = std::nullopt) override;
     void rollbackTo(std::string id) override;
+    CleanupState cleanup(CleanupState state, bool important) override;
+protected:
+    std::string getBooted();
+    std::string joinIds(const std::vector<std::string>& ids);
 private:
     std::string callSnapper(std::string);
 };
@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Reader for snapper's info.xml
+ */
+
+#include "SnapperInfo.hpp"
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+// Resolve the predefined XML entities and character references
+static std::string unescape(const std::string& text) {
+    static const std::map<std::string, std::string> entities{
+        {"amp", "&"}, {"lt", "<"}, {"gt", ">"}, {"quot", "\""}, {"apos", "'"}};
+    std::string result;
+    size_t pos = 0;
+    for (size_t amp; (amp = text.find('&', pos)) != std::string::npos; ) {
+        size_t semicolon = text.find(';', amp);
+        if (semicolon == std::string::npos)
+            throw std::runtime_error{"Invalid entity in '" + text + "'."};
+        std::string name = text.substr(amp + 1, semicolon - amp - 1);
+        result += text.substr(pos, amp - pos);
+        if (name.size() > 1 && name[0] == '#') {
+            unsigned long c = name[1] == 'x' ? std::stoul(name.substr(2), nullptr, 16) : std::stoul(name.substr(1));
+            // UTF-8 encoding
+            if (c < 0x80) {
+                result += char(c);
+            } else if (c < 0x800) {
+                result += char(0xC0 | (c >> 6));
+                result += char(0x80 | (c & 0x3F));
+            } else if (c < 0x10000) {
+                result += char(0xE0 | (c >> 12));
+                result += char(0x80 | ((c >> 6) & 0x3F));
+                result += char(0x80 | (c & 0x3F));
+            } else {
+                result += char(0xF0 | (c >> 18));
+                result += char(0x80 | ((c >> 12) & 0x3F));
+                result += char(0x80 | ((c >> 6) & 0x3F));
+                result += char(0x80 | (c & 0x3F));
+            }
+        } else if (entities.count(name)) {
+            result += entities.at(name);
+        } else {
+            throw std::runtime_error{"Unknown entity '&" + name + ";'."};
+        }
+        pos = semicolon + 1;
+    }
+    return result + text.substr(pos);
+}
+
+// Minimal streaming parser for the flat structure snapper writes:
+// <snapshot><num>1</num>...<userdata><key>k</key><value>v</value></userdata></snapshot>
+SnapperInfo::SnapperInfo(const std::filesystem::path& file) {
+    std::ifstream input{file};
+    if (!input)
+        throw std::runtime_error{"Couldn't open '" + file.native() + "'."};
+
+    std::vector<std::string> open;
+    std::string text;
+    std::string key;
+    bool hasElements = false;
+    for (char c; input.get(c); ) {
+        if (c != '<') {
+            text += c;
+            continue;
+        }
+        std::string tag;
+        if (!std::getline(input, tag, '>'))
+            throw std::runtime_error{"Unterminated tag in '" + file.native() + "'."};
+
+        // XML declaration, comments, ...
+        if (tag.empty() || tag[0] == '?' || tag[0] == '!') {
+            text.clear();
+            continue;
+        }
+
+        bool closing = tag[0] == '/';
+        bool empty = tag.back() == '/';
+        if (!closing) {
+            open.push_back(tag.substr(0, tag.find_first_of(" \t\r\n/")));
+            text.clear();
+        }
+        if (closing || empty) {
+            if (open.empty() || (closing && open.back() != tag.substr(1)))
+                throw std::runtime_error{"Unexpected closing tag '" + tag + "' in '" + file.native() + "'."};
+            std::string value = unescape(text);
+            if (open.size() == 2 && open[0] == "snapshot")
+                hasElements = true;
+            else if (open.size() == 3 && open[1] == "userdata" && open[2] == "key")
+                key = value;
+            else if (open.size() == 3 && open[1] == "userdata" && open[2] == "value")
+                userdata[key] = value;
+            open.pop_back();
+            text.clear();
+        }
+    }
+    if (!open.empty() || !hasElements)
+        throw std::runtime_error{"Incomplete snapshot information in '" + file.native() + "'."};
+}
+
+std::string SnapperInfo::getUserdata(const std::string& key) {
+    auto it = userdata.find(key);
+    return it == userdata.end() ? "" : it->second;
+}
+
+} // namespace TransactionalUpdate
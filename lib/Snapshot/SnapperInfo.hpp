@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Read-only access to the userdata snapper stores in /.snapshots/<id>/info.xml;
+  much cheaper than a full `snapper list` when only a single snapshot is of
+  interest. Modifications still have to be done via snapper.
+ */
+
+#ifndef T_U_SNAPPER_INFO_H
+#define T_U_SNAPPER_INFO_H
+
+#include <filesystem>
+#include <map>
+#include <string>
+
+namespace TransactionalUpdate {
+
+class SnapperInfo {
+public:
+    SnapperInfo(const std::filesystem::path& file);
+    std::string getUserdata(const std::string& key);
+private:
+    std::map<std::string, std::string> userdata;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_SNAPPER_INFO_H
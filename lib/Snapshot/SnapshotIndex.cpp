@@ -0,0 +1,205 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Metadata index for snapshot backends without a snapshot manager of their own
+ */
+
+#include "SnapshotIndex.hpp"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <sys/file.h>
+#include <unistd.h>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+// Tabs and newlines separate the fields and entries
+static std::string escape(const std::string& field) {
+    std::string result;
+    for (char c: field) {
+        if (c == '\\')
+            result += "\\\\";
+        else if (c == '\t')
+            result += "\\t";
+        else if (c == '\n')
+            result += "\\n";
+        else
+            result += c;
+    }
+    return result;
+}
+
+static std::string unescape(const std::string& field) {
+    std::string result;
+    for (size_t i = 0; i < field.size(); i++) {
+        if (field[i] != '\\' || i + 1 == field.size()) {
+            result += field[i];
+            continue;
+        }
+        char c = field[++i];
+        result += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+    }
+    return result;
+}
+
+SnapshotIndex::SnapshotIndex(const std::filesystem::path& dir, bool exclusive): file{dir / "tukit.index"} {
+    lockFd = ::open((file.native() + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lockFd < 0)
+        throw std::runtime_error{"Opening lock of snapshot index failed: " + std::string(strerror(errno))};
+    try {
+        if (flock(lockFd, exclusive ? LOCK_EX : LOCK_SH) < 0)
+            throw std::runtime_error{"Locking snapshot index failed: " + std::string(strerror(errno))};
+
+        std::ifstream input{file};
+        for (std::string line; std::getline(input, line); ) {
+            if (line.empty() || line[0] == '#')
+                continue;
+            std::vector<std::string> fields;
+            for (size_t pos = 0; ; ) {
+                size_t tab = line.find('\t', pos);
+                fields.push_back(unescape(line.substr(pos, tab - pos)));
+                if (tab == std::string::npos)
+                    break;
+                pos = tab + 1;
+            }
+            if (fields.size() != 6 || fields[0].empty() || fields[0].find_first_not_of("0123456789") != std::string::npos)
+                throw std::runtime_error{"Invalid entry in snapshot index: '" + line + "'"};
+            Entry& entry = entries[std::stoul(fields[0])];
+            entry.parent = fields[1];
+            entry.date = fields[2];
+            entry.cleanup = fields[3];
+            entry.description = fields[4];
+            parseUserdata(fields[5], entry.userdata);
+        }
+    } catch (...) {
+        ::close(lockFd);
+        throw;
+    }
+}
+
+SnapshotIndex::~SnapshotIndex() {
+    ::close(lockFd);
+}
+
+SnapshotIndex::Entry& SnapshotIndex::at(const std::string& id) {
+    auto it = entries.end();
+    if (!id.empty() && id.find_first_not_of("0123456789") == std::string::npos)
+        it = entries.find(std::stoul(id));
+    if (it == entries.end())
+        throw std::invalid_argument{"Snapshot " + id + " does not exist."};
+    return it->second;
+}
+
+unsigned long SnapshotIndex::nextId() {
+    unsigned long id = entries.empty() ? 1 : entries.rbegin()->first + 1;
+    // Never reuse the number of a snapshot directory which isn't in the index (anymore)
+    while (std::filesystem::exists(file.parent_path() / std::to_string(id)))
+        id++;
+    return id;
+}
+
+// Readers must never see a partially written file
+void SnapshotIndex::write() {
+    std::filesystem::path tmp = file.native() + ".new";
+    {
+        std::ofstream output{tmp, std::ios::trunc};
+        output << "# number\tparent\tdate\tcleanup\tdescription\tuserdata\n";
+        for (auto& [id, entry]: entries) {
+            output << id << "\t" << escape(entry.parent) << "\t" << escape(entry.date) << "\t"
+                   << escape(entry.cleanup) << "\t" << escape(entry.description) << "\t"
+                   << escape(joinUserdata(entry.userdata, ",")) << "\n";
+        }
+        output.flush();
+        if (!output)
+            throw std::runtime_error{"Writing " + tmp.native() + " failed."};
+    }
+    int fd = ::open(tmp.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+    std::filesystem::rename(tmp, file);
+}
+
+std::deque<std::map<std::string, std::string>> SnapshotIndex::getList(std::string columns,
+        const std::function<std::string(const std::string& id, const std::string& column)>& getColumn) {
+    std::deque<std::map<std::string, std::string>> snapshotList;
+
+    if (columns.empty())
+        columns="number,date,description";
+    std::vector<std::string> headers;
+    std::stringstream columnsStream{columns};
+    for (std::string column; std::getline(columnsStream, column, ','); )
+        headers.push_back(column);
+
+    for (auto& [id, entry]: entries) {
+        std::string number = std::to_string(id);
+        std::map<std::string, std::string> snapshot;
+        for (auto& column: headers) {
+            std::string value;
+            if (column == "number")
+                value = number;
+            else if (column == "type")
+                value = "single";
+            else if (column == "parent")
+                value = entry.parent;
+            else if (column == "date")
+                value = entry.date;
+            else if (column == "cleanup")
+                value = entry.cleanup;
+            else if (column == "description")
+                value = entry.description;
+            else if (column == "userdata")
+                value = joinUserdata(entry.userdata, ", ");
+            else
+                value = getColumn(number, column);
+            snapshot.emplace(column, value);
+        }
+        snapshotList.push_back(snapshot);
+    }
+    return snapshotList;
+}
+
+void SnapshotIndex::parseUserdata(const std::string& userdata, std::map<std::string, std::string>& map) {
+    std::stringstream userdataStream{userdata};
+    for (std::string item; std::getline(userdataStream, item, ','); ) {
+        size_t first = item.find_first_not_of(' ');
+        if (first == std::string::npos)
+            continue;
+        item = item.substr(first);
+        size_t equals = item.find('=');
+        if (equals == std::string::npos || equals == 0)
+            throw std::invalid_argument{"Invalid userdata '" + item + "'."};
+        std::string key = item.substr(0, equals);
+        std::string value = item.substr(equals + 1);
+        if (value.empty())
+            map.erase(key);
+        else
+            map[key] = value;
+    }
+}
+
+std::string SnapshotIndex::joinUserdata(const std::map<std::string, std::string>& map, const std::string& separator) {
+    std::string joined;
+    for (auto& [key, value]: map)
+        joined += (joined.empty() ? "" : separator) + key + "=" + value;
+    return joined;
+}
+
+std::string SnapshotIndex::getDate() {
+    std::time_t now = std::time(nullptr);
+    std::tm tm;
+    gmtime_r(&now, &tm);
+    std::ostringstream date;
+    date << std::put_time(&tm, "%F %T");
+    return date.str();
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Metadata index for snapshot backends without a snapshot manager of their
+  own; stored as "tukit.index" in the snapshot directory with one tab
+  separated line per snapshot.
+ */
+
+#ifndef T_U_SNAPSHOTINDEX_H
+#define T_U_SNAPSHOTINDEX_H
+
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <string>
+
+namespace TransactionalUpdate {
+
+class SnapshotIndex {
+public:
+    struct Entry {
+        std::string parent;
+        std::string date;
+        std::string cleanup;
+        std::string description;
+        std::map<std::string, std::string> userdata;
+    };
+
+    /**
+     * @brief Read the index; it stays locked (shared or exclusive) for the lifetime of the object
+     */
+    SnapshotIndex(const std::filesystem::path& dir, bool exclusive = false);
+    SnapshotIndex(const SnapshotIndex&) = delete;
+    ~SnapshotIndex();
+
+    /**
+     * @brief Return the entry of snapshot @id; throws std::invalid_argument if it doesn't exist
+     */
+    Entry& at(const std::string& id);
+    /**
+     * @brief Return the number for a new snapshot, i.e. one higher than the highest existing one
+     */
+    unsigned long nextId();
+    /**
+     * @brief Replace the index file atomically with the current entries
+     */
+    void write();
+    /**
+     * @brief List snapshots as SnapshotManager::getList() does; columns not stored in the
+     * index are requested from @getColumn
+     */
+    std::deque<std::map<std::string, std::string>> getList(std::string columns,
+            const std::function<std::string(const std::string& id, const std::string& column)>& getColumn);
+
+    /**
+     * @brief Modify @map according to @userdata in the form "key=value[,key=value]"; an
+     * empty value removes the key
+     */
+    static void parseUserdata(const std::string& userdata, std::map<std::string, std::string>& map);
+    static std::string joinUserdata(const std::map<std::string, std::string>& map, const std::string& separator);
+    /**
+     * @brief Current UTC time in the format used by snapper, e.g. for Entry::date
+     */
+    static std::string getDate();
+
+    std::map<unsigned long, Entry> entries;
+private:
+    std::filesystem::path file;
+    int lockFd;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_SNAPSHOTINDEX_H
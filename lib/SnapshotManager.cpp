@@ -8,6 +8,8 @@
 
 #include "Configuration.hpp"
 #include "Log.hpp"
+#include "Snapshot/BtrfsSnapshots.hpp"
+#include "Snapshot/Overlay.hpp"
 #include "Snapshot/Snapper.hpp"
 #include "Snapshot/Podman.hpp"
 using namespace std;
@@ -30,6 +32,10 @@ unique_ptr<SnapshotManager> SnapshotFactory::get() {
         return make_unique<Snapper>();
     } else if (sm == "podman") {
         return make_unique<Podman>();
+    } else if (sm == "btrfs") {
+        return make_unique<BtrfsSnapshots>();
+    } else if (sm == "overlay") {
+        return make_unique<Overlay>();
     } else {
         throw runtime_error{"Unsupported snapshot manager '" + sm + "'."};
     }
@@ -15,12 +15,24 @@
 #include <deque>
 #include <map>
 #include <memory>
+#include <optional>
 #include <string>
+#include <vector>
 
 namespace TransactionalUpdate {
 
 class Snapshot;
 
+/**
+ * @brief Snapshots to be handled by SnapshotManager::cleanup()
+ */
+struct CleanupState {
+    /** Snapshots which were in use before and may be removed once they are not needed anymore */
+    std::vector<std::string> previous;
+    /** Snapshots which are not used at all, e.g. from failed or superseded transactions */
+    std::vector<std::string> unused;
+};
+
 /**
  * @brief The SnapshotManager class is an abstract class and may return different implementations, though
  * currently only snapper is implemented as a backend.
@@ -65,11 +77,42 @@ public:
      */
     virtual void deleteSnap(std::string id) = 0;
 
+    /**
+     * @brief deleteSnaps Deletes all given snapshots in one operation; the same restrictions as
+     * for deleteSnap() apply. Nothing is done if @ids is empty.
+     * @param ids IDs of the snapshots to be deleted.
+     */
+    virtual void deleteSnaps(std::vector<std::string> ids) = 0;
+
+    /**
+     * @brief modifySnaps Changes the metadata of all given snapshots in one operation
+     * @param ids IDs of the snapshots to be modified.
+     * @param cleanupAlgorithm (optional) The new cleanup algorithm, e.g. "number"; an empty string
+     * removes the cleanup algorithm.
+     * @param userdata (optional) Userdata to set in the form "key=value[,key=value]"; an empty
+     * value removes the key.
+     */
+    virtual void modifySnaps(std::vector<std::string> ids, std::optional<std::string> cleanupAlgorithm, std::optional<std::string> userdata = std::nullopt) = 0;
+
     /**
      * @brief Set the given snapshot ID as the default snapshot ID
      * @param id ID of the snapshot to be rolled back to.
      */
     virtual void rollbackTo(std::string id) = 0;
+
+    /**
+     * @brief cleanup Hand snapshots which aren't needed anymore over to the "number" cleanup
+     * algorithm, so they will be removed by the snapshot manager's regular cleanup
+     * @param state Previously used and unused snapshots
+     * @param important Also mark the previously used snapshots as important, so they will be
+     * kept longer (e.g. on read-only systems)
+     * @return The snapshots which couldn't be marked yet, e.g. because they are currently in use;
+     * they should be passed to the next call again.
+     *
+     * Snapshots of aborted transactions are detected automatically. The current, the booted
+     * and the default snapshot will never be marked. All changes are applied in one batch.
+     */
+    virtual CleanupState cleanup(CleanupState state, bool important) = 0;
 };
 
 class SnapshotFactory {
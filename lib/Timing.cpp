@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Phase timing instrumentation
+ */
+
+#include "Timing.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <map>
+
+namespace TransactionalUpdate {
+
+using namespace std;
+
+static string jsonEscape(const string& s) {
+    string escaped;
+    for (unsigned char c: s) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c < 0x20) {
+            char buf[7];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            escaped += buf;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+void Timings::add(Timing timing) {
+    lock_guard<mutex> guard{lock};
+    timings.push_back(move(timing));
+}
+
+vector<Timing> Timings::get() {
+    lock_guard<mutex> guard{lock};
+    return timings;
+}
+
+string Timings::toJson(const string& transaction) {
+    auto record = get();
+    map<string, chrono::microseconds> phases;
+    string json = "{\"transaction\":\"" + jsonEscape(transaction) + "\",\"timings\":[";
+    for (auto it = record.begin(); it != record.end(); ++it) {
+        if (it != record.begin())
+            json += ",";
+        json += "{\"phase\":\"" + jsonEscape(it->phase) + "\"";
+        if (!it->detail.empty())
+            json += ",\"detail\":\"" + jsonEscape(it->detail) + "\"";
+        json += ",\"usec\":" + to_string(it->duration.count()) + "}";
+        phases[it->phase] += it->duration;
+    }
+    json += "],\"phases\":{";
+    for (auto it = phases.begin(); it != phases.end(); ++it) {
+        if (it != phases.begin())
+            json += ",";
+        json += "\"" + jsonEscape(it->first) + "\":" + to_string(it->second.count());
+    }
+    json += "}}";
+    return json;
+}
+
+void Timings::report(const string& transaction) {
+    tulog.debug("Timings: ", toJson(transaction));
+
+    map<string, chrono::microseconds> phases;
+    for (auto& timing: get()) {
+        phases[timing.phase] += timing.duration;
+    }
+    string summary;
+    vector<string> fields;
+    for (auto& [phase, duration]: phases) {
+        char seconds[32];
+        snprintf(seconds, sizeof(seconds), "%.3fs", duration.count() / 1e6);
+        summary += " " + phase + "=" + seconds;
+        string name = phase;
+        transform(name.begin(), name.end(), name.begin(), [](unsigned char c) {
+            return isalnum(c) ? toupper(c) : '_';
+        });
+        fields.push_back("TIMING_" + name + "_USEC=" + to_string(duration.count()));
+    }
+    tulog.infoFields(fields, "Timings of transaction ", transaction, ":", summary);
+}
+
+ScopedTimer::ScopedTimer(string phase, string detail):
+    timings{currentTimings}, phase{move(phase)}, detail{move(detail)}, start{chrono::steady_clock::now()} {
+}
+
+ScopedTimer::~ScopedTimer() {
+    auto duration = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    metrics.observe("tukit_phase_duration_seconds", duration.count() / 1e6, {{"phase", phase}});
+    if (timings != nullptr)
+        timings->add({phase, detail, duration});
+}
+
+} // namespace TransactionalUpdate
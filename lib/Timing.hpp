@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Phase timing instrumentation: A ScopedTimer measures the runtime of a phase
+  using a monotonic clock and adds it to the timing record of the transaction
+  the current thread is working on.
+ */
+
+#ifndef T_U_TIMING_H
+#define T_U_TIMING_H
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+struct Timing {
+    std::string phase;
+    std::string detail;
+    std::chrono::microseconds duration;
+};
+
+class Timings {
+public:
+    void add(Timing timing);
+    std::vector<Timing> get();
+    /**
+     * @brief Return the timing record as a single line JSON object
+     *
+     * Contains the individual measurements in the order they finished as well as the sum
+     * per phase.
+     */
+    std::string toJson(const std::string& transaction);
+    /**
+     * @brief Log the sums per phase at info level, also as TIMING_<PHASE>_USEC journal
+     * fields; the full JSON record is only logged in debug mode
+     */
+    void report(const std::string& transaction);
+private:
+    std::mutex lock;
+    std::vector<Timing> timings;
+};
+
+// Timing record of the transaction the current thread is working on, if any
+inline thread_local Timings* currentTimings = nullptr;
+
+// Makes @timings the current thread's timing record until the end of the scope
+class TimingScope {
+public:
+    TimingScope(Timings& timings): previous{currentTimings} {
+        currentTimings = &timings;
+    }
+    ~TimingScope() {
+        currentTimings = previous;
+    }
+private:
+    Timings* previous;
+};
+
+class ScopedTimer {
+public:
+    ScopedTimer(std::string phase, std::string detail = "");
+    ~ScopedTimer();
+private:
+    Timings* timings;
+    std::string phase;
+    std::string detail;
+    std::chrono::steady_clock::time_point start;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_TIMING_H
@@ -10,52 +10,74 @@
 #include "Transaction.hpp"
 #include "Configuration.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 #include "Mount.hpp"
 #include "Plugins.hpp"
 #include "SnapshotManager.hpp"
 #include "Snapshot.hpp"
 #include "Supplement.hpp"
+#include "Timing.hpp"
 #include "Util.hpp"
 #include <algorithm>
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <fstream>
-#include <ftw.h>
+#include <functional>
+#include <fts.h>
 #include <limits.h>
 #include <poll.h>
 #include <sched.h>
 #include <selinux/restorecon.h>
 #include <selinux/selinux.h>
+#include <set>
+#include <shared_mutex>
 #include <signal.h>
 #include <sys/inotify.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <unordered_set>
 #include <utime.h>
 using namespace TransactionalUpdate;
 namespace fs = std::filesystem;
 
-static int inotifyFd;
-std::vector<std::filesystem::path> inotifyExcludes;
-
 class Transaction::impl {
 public:
     void addSupplements();
     void snapMount();
     void closeSnapshot(bool aborted=false);
-    int runCommand(char* argv[], bool inChroot, std::string* buffer);
-    static int inotifyAdd(const char *pathname, const struct stat *sbuf, int type, struct FTW *ftwb);
+    int runCommand(char* argv[], bool inChroot, const OutputCallback& output);
+    void inotifyAdd();
     static int selinux_logging_callback(int type, const char *fmt, ...);
+    static int relabelVar(size_t threads);
     int inotifyRead();
+    void syncSnapshot();
+    // Declared first, so it will still be available while the other members are destroyed
+    Timings timings;
     std::unique_ptr<SnapshotManager> snapshotMgr;
     std::unique_ptr<Snapshot> snapshot;
     fs::path bindDir;
     std::vector<std::unique_ptr<Mount>> dirsToMount;
+    // Writable directories outside of the snapshot which have to be durable
+    // together with it (e.g. the EFI partition)
+    std::vector<fs::path> syncDirs;
     Supplements supplements;
-    pid_t pidCmd;
+    // Commands may run concurrently (shared), while closing or discarding the
+    // transaction requires exclusive access
+    std::shared_mutex commandLock;
+    std::mutex pidLock;
+    std::set<pid_t> pidsCmd;
+    std::mutex inotifyLock;
     bool keepIfError = false;
     bool discardIfNoChange = false;
+    // Change detection for discardIfNoChange; -1 if not watching
+    int inotifyFd = -1;
+    // Mount namespace of the bind mounts; it belongs to the thread which called snapMount()
+    int mountNs = -1;
+    std::vector<fs::path> inotifyExcludes;
 };
 
 Transaction::Transaction() : pImpl{std::make_unique<impl>()} {
@@ -68,9 +90,13 @@ Transaction::Transaction() : pImpl{std::make_unique<impl>()} {
 
 Transaction::~Transaction() {
     tulog.debug("Destructor Transaction");
+    TimingScope timingScope{pImpl->timings};
+    std::unique_lock<std::shared_mutex> commandLock{pImpl->commandLock};
 
-    if (inotifyFd != 0)
-        close(inotifyFd);
+    if (pImpl->inotifyFd >= 0)
+        close(pImpl->inotifyFd);
+    if (pImpl->mountNs >= 0)
+        close(pImpl->mountNs);
 
     pImpl->dirsToMount.clear();
     if (!pImpl->bindDir.empty()) {
@@ -83,6 +109,7 @@ Transaction::~Transaction() {
     try {
         if (isInitialized() && !getSnapshot().empty() && fs::exists(getRoot())) {
             tulog.info("Discarding snapshot ", pImpl->snapshot->getUid(), ".");
+            metrics.increment("tukit_transactions_total", {{"event", "aborted"}});
             if (pImpl->keepIfError) {
                 pImpl->closeSnapshot(true);
             } else {
@@ -107,6 +134,10 @@ std::string Transaction::getSnapshot() {
     return pImpl->snapshot->getUid();
 }
 
+std::string Transaction::getTimings() {
+    return pImpl->timings.toJson(pImpl->snapshot ? pImpl->snapshot->getUid() : "");
+}
+
 fs::path Transaction::getRoot() {
     return pImpl->snapshot->getRoot();
 }
@@ -137,10 +168,126 @@ int Transaction::impl::selinux_logging_callback(int type, const char *fmt, ...)
     return 0;
 }
 
+// Record of the inodes below the snapshot's (shadowed) /var which have been relabelled already
+static const char* relabelRecord = "/var/.tukit-relabelled";
+
+// Walks the tree below root without crossing file system boundaries. In
+// contrast to nftw all state is passed to the callback, so it can be used from
+// several threads at once. If fn returns false for a directory its contents
+// will be skipped.
+static void walkTree(const fs::path& root, const std::function<bool(const FTSENT* entry)>& fn) {
+    std::string rootPath = root.native();
+    char* paths[] = {rootPath.data(), nullptr};
+    FTS* fts = fts_open(paths, FTS_PHYSICAL | FTS_XDEV | FTS_NOCHDIR, nullptr);
+    if (fts == nullptr)
+        throw std::runtime_error{"Traversing " + rootPath + " failed: " + std::string(strerror(errno))};
+    while (FTSENT* entry = fts_read(fts)) {
+        if (entry->fts_info == FTS_DP || entry->fts_info == FTS_NS || entry->fts_info == FTS_ERR)
+            continue;
+        if (!fn(entry))
+            fts_set(fts, entry, FTS_SKIP);
+    }
+    fts_close(fts);
+}
+
+static std::string relabelKey(const struct stat* st) {
+    return std::to_string(st->st_ino) + " " + std::to_string(st->st_ctim.tv_sec) + "." + std::to_string(st->st_ctim.tv_nsec);
+}
+
+// Identifies the file contexts in use; any change to them requires a full relabel
+static std::string selinuxPolicyId() {
+    std::string id;
+    std::string fileContexts = selinux_file_context_path();
+    for (auto suffix: {"", ".bin", ".local", ".local.bin", ".homedirs", ".homedirs.bin", ".subs", ".subs_dist"}) {
+        struct stat st;
+        if (stat((fileContexts + suffix).c_str(), &st) == 0)
+            id += fileContexts + suffix + ":" + std::to_string(st.st_size) + ":" + std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec) + ";";
+    }
+    return id;
+}
+
+// To be called in the chroot of the snapshot. Files in /var have been relabelled during the
+// previous transactions already (and the new snapshot inherited those labels), so only
+// relabel inodes which were created or changed since then. Does a full relabel if the file
+// contexts changed or no record exists yet, using the given number of threads if supported
+// by libselinux (0 = one per CPU).
+int Transaction::impl::relabelVar(size_t threads) {
+    unsigned int restoreconOptions = SELINUX_RESTORECON_XDEV;
+    if (tulog.level >= TULogLevel::Info)
+        restoreconOptions |= SELINUX_RESTORECON_VERBOSE;
+
+    std::string policy = selinuxPolicyId();
+    std::ifstream input{relabelRecord};
+    std::string line;
+    std::getline(input, line);
+    if (!input || line != policy) {
+        tulog.debug("No relabel record for current file contexts, relabelling all of /var.");
+        restoreconOptions |= SELINUX_RESTORECON_RECURSE | SELINUX_RESTORECON_IGNORE_DIGEST;
+#ifdef HAVE_SELINUX_RESTORECON_PARALLEL
+        int rc = selinux_restorecon_parallel("/var", restoreconOptions, threads);
+#else
+        (void)threads;
+        int rc = selinux_restorecon("/var", restoreconOptions);
+#endif
+        if (rc < 0) {
+            tulog.error("Relabelling of snapshot /var failed: " + std::string(strerror(errno)));
+            return errno;
+        }
+    } else {
+        std::unordered_set<std::string> relabelled;
+        while (std::getline(input, line))
+            relabelled.insert(line);
+        std::vector<std::string> changed;
+        walkTree("/var", [&](const FTSENT* entry) {
+            if (relabelled.count(relabelKey(entry->fts_statp)) == 0 && strcmp(entry->fts_path, relabelRecord) != 0)
+                changed.push_back(entry->fts_path);
+            return true;
+        });
+        tulog.debug("Relabelling ", changed.size(), " changed entries in /var.");
+        for (auto& path: changed) {
+            if (selinux_restorecon(path.c_str(), restoreconOptions) < 0 && errno != ENOENT) {
+                tulog.error("Relabelling of snapshot " + path + " failed: " + std::string(strerror(errno)));
+                return errno;
+            }
+        }
+    }
+    input.close();
+
+    // Labels changed the ctime, so record the state after relabelling
+    std::string tmpRecord = std::string(relabelRecord) + ".new";
+    std::ofstream output{tmpRecord};
+    output << policy << "\n";
+    walkTree("/var", [&](const FTSENT* entry) {
+        output << relabelKey(entry->fts_statp) << "\n";
+        return true;
+    });
+    output.close();
+    if (output.fail() || rename(tmpRecord.c_str(), relabelRecord) != 0) {
+        // Not fatal, the next transaction will just relabel everything again
+        tulog.info("WARNING: Could not write SELinux relabel record ", relabelRecord);
+        unlink(tmpRecord.c_str());
+    }
+    return 0;
+}
+
 void Transaction::impl::snapMount() {
+    ScopedTimer timer{"snap-mount"};
+    std::optional<ScopedTimer> relabelTimer;
+    pid_t relabelPid = 0;
+    // Don't leave the relabelling process behind if mounting fails
+    std::unique_ptr<pid_t, std::function<void(pid_t*)>> relabelGuard{&relabelPid, [](pid_t* pid) {
+        if (*pid > 0)
+            waitpid(*pid, nullptr, 0);
+    }};
     if (unshare(CLONE_NEWNS) < 0) {
         throw std::runtime_error{"Creating new mount namespace failed: " + std::string(strerror(errno))};
     }
+    if (mountNs >= 0)
+        close(mountNs);
+    mountNs = open("/proc/thread-self/ns/mnt", O_RDONLY | O_CLOEXEC);
+    if (mountNs < 0) {
+        throw std::runtime_error{"Opening mount namespace failed: " + std::string(strerror(errno))};
+    }
 
     // GRUB needs to have an actual mount point for the root partition, so
     // mount the snapshot directory on a temporary mount point
@@ -152,55 +299,66 @@ void Transaction::impl::snapMount() {
 
     dirsToMount.push_back(std::make_unique<PropagatedBindMount>("/dev"));
     dirsToMount.push_back(std::make_unique<BindMount>("/var/log"));
+    syncDirs.push_back("/var/log");
 
     Mount mntVar{"/var"};
     if (mntVar.isMount()) {
-        if (fs::is_directory("/var/lib/zypp"))
+        if (fs::is_directory("/var/lib/zypp")) {
             dirsToMount.push_back(std::make_unique<BindMount>("/var/lib/zypp"));
+            syncDirs.push_back("/var/lib/zypp");
+        }
         dirsToMount.push_back(std::make_unique<BindMount>("/var/lib/ca-certificates"));
-        if (fs::is_directory("/var/lib/alternatives"))
+        syncDirs.push_back("/var/lib/ca-certificates");
+        if (fs::is_directory("/var/lib/alternatives")) {
             dirsToMount.push_back(std::make_unique<BindMount>("/var/lib/alternatives"));
-        if (fs::is_directory("/var/lib/selinux"))
+            syncDirs.push_back("/var/lib/alternatives");
+        }
+        if (fs::is_directory("/var/lib/selinux")) {
             dirsToMount.push_back(std::make_unique<BindMount>("/var/lib/selinux"));
+            syncDirs.push_back("/var/lib/selinux");
+        }
         if (is_selinux_enabled()) {
             // If packages installed files into /var (which is not allowed, but still happens), they will end
             // up in the root file system, but will always be shadowed by the real /var mount. Due to that they
             // also won't be relabelled at any time. During updates this may cause problems if packages try to
             // access those leftover directories with wrong permissions, so they have to be relabelled manually...
-            if (fs::is_directory("/var/lib/selinux")) {
-                BindMount selinuxVar("/var/lib/selinux", 0, true);
-                selinuxVar.mount(bindDir);
+            // restorecon keeps open file handles, so execute it in a child process with its own mount namespace -
+            // umount will fail otherwise. This way the remaining directories can be mounted in the meantime.
+            size_t relabelThreads;
+            try {
+                std::string value = config.get("SELINUX_RELABEL_THREADS");
+                // std::stoul would silently wrap negative numbers
+                if (value.find('-') != std::string::npos)
+                    throw std::out_of_range{value};
+                relabelThreads = std::stoul(value);
+            } catch (const std::logic_error &e) {
+                throw std::invalid_argument{"Invalid value for SELINUX_RELABEL_THREADS: '" + config.get("SELINUX_RELABEL_THREADS") + "'"};
             }
-            BindMount selinuxEtc("/etc/selinux", 0, true);
-            selinuxEtc.mount(bindDir);
-
-            // restorecon keeps open file handles, so execute it in a child process - umount will fail otherwise
-            pid_t childPid = fork();
-            if (childPid < 0) {
+            relabelTimer.emplace("selinux-relabel");
+            relabelPid = fork();
+            if (relabelPid < 0) {
                 throw std::runtime_error{"Forking for SELinux relabelling failed: " + std::string(strerror(errno))};
-            } else if (childPid == 0) {
-                if (chroot(bindDir.c_str()) < 0) {
-                    tulog.error("Chrooting to " + bindDir.native() + " for SELinux relabelling failed: " + std::string(strerror(errno)));
-                    _exit(errno);
-                }
-
-                union selinux_callback se_callback;
-                se_callback.func_log = selinux_logging_callback;
-                selinux_set_callback(SELINUX_CB_LOG, se_callback);
-                unsigned int restoreconOptions = SELINUX_RESTORECON_RECURSE | SELINUX_RESTORECON_IGNORE_DIGEST;
-                if (tulog.level >= TULogLevel::Info)
-                    restoreconOptions |= SELINUX_RESTORECON_VERBOSE;
-                if (selinux_restorecon("/var", restoreconOptions) < 0) {
-                    tulog.error("Relabelling of snapshot /var failed: " + std::string(strerror(errno)));
-                    _exit(errno);
-                }
-                _exit(0);
-            }
-            else {
-                int status;
-                waitpid(childPid, &status, 0);
-                if ((WIFEXITED(status) && WEXITSTATUS(status) != 0) || WIFSIGNALED(status)) {
-                    throw std::runtime_error{"SELinux relabelling failed."};
+            } else if (relabelPid == 0) {
+                try {
+                    if (unshare(CLONE_NEWNS) < 0 || mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) < 0) {
+                        tulog.error("Creating mount namespace for SELinux relabelling failed: " + std::string(strerror(errno)));
+                        _exit(errno);
+                    }
+                    if (fs::is_directory("/var/lib/selinux"))
+                        BindMount{"/var/lib/selinux"}.mount(bindDir);
+                    BindMount{"/etc/selinux"}.mount(bindDir);
+                    if (chroot(bindDir.c_str()) < 0) {
+                        tulog.error("Chrooting to " + bindDir.native() + " for SELinux relabelling failed: " + std::string(strerror(errno)));
+                        _exit(errno);
+                    }
+
+                    union selinux_callback se_callback;
+                    se_callback.func_log = selinux_logging_callback;
+                    selinux_set_callback(SELINUX_CB_LOG, se_callback);
+                    _exit(relabelVar(relabelThreads));
+                } catch (const std::exception &e) {
+                    tulog.error("Relabelling of snapshot /var failed: ", e.what());
+                    _exit(1);
                 }
             }
         }
@@ -227,40 +385,62 @@ void Transaction::impl::snapMount() {
     if (fs::exists("/boot/grub2")) {
         for (auto& path: fs::directory_iterator("/boot/grub2")) {
             if (fs::is_directory(path)) {
-                if (BindMount{path.path()}.isMount())
+                if (BindMount{path.path()}.isMount()) {
                     dirsToMount.push_back(std::make_unique<BindMount>(path.path()));
+                    syncDirs.push_back(path.path());
+                }
             }
         }
     }
-    if (BindMount{"/boot/efi"}.isMount())
+    if (BindMount{"/boot/efi"}.isMount()) {
         dirsToMount.push_back(std::make_unique<BindMount>("/boot/efi"));
-    if (BindMount{"/boot/zipl"}.isMount())
+        syncDirs.push_back("/boot/efi");
+    }
+    if (BindMount{"/boot/zipl"}.isMount()) {
         dirsToMount.push_back(std::make_unique<BindMount>("/boot/zipl"));
+        syncDirs.push_back("/boot/zipl");
+    }
 
     dirsToMount.push_back(std::make_unique<PropagatedBindMount>("/proc"));
     dirsToMount.push_back(std::make_unique<PropagatedBindMount>("/sys"));
 
-    if (BindMount{"/root"}.isMount())
+    if (BindMount{"/root"}.isMount()) {
         dirsToMount.push_back(std::make_unique<BindMount>("/root"));
+        syncDirs.push_back("/root");
+    }
 
-    if (BindMount{"/boot/writable"}.isMount())
+    if (BindMount{"/boot/writable"}.isMount()) {
         dirsToMount.push_back(std::make_unique<BindMount>("/boot/writable"));
+        syncDirs.push_back("/boot/writable");
+    }
 
     std::vector<std::string> customDirs = config.getArray("BINDDIRS");
     for (auto it = customDirs.begin(); it != customDirs.end(); ++it) {
-        if (fs::is_directory(*it))
+        if (fs::is_directory(*it)) {
             dirsToMount.push_back(std::make_unique<BindMount>(*it));
-        else
+            syncDirs.push_back(*it);
+        } else
             tulog.info("Not bind mounting directory '" + *it + "' as it doesn't exist.");
     }
 
-    dirsToMount.push_back(std::make_unique<BindMount>("/.snapshots"));
+    if (fs::is_directory("/.snapshots"))
+        dirsToMount.push_back(std::make_unique<BindMount>("/.snapshots"));
 
     for (auto it = dirsToMount.begin(); it != dirsToMount.end(); ++it) {
         it->get()->mount(bindDir);
     }
 
     dirsToMount.push_back(std::move(mntBind));
+
+    if (relabelPid > 0) {
+        int status;
+        waitpid(relabelPid, &status, 0);
+        relabelPid = 0;
+        relabelTimer.reset();
+        if ((WIFEXITED(status) && WEXITSTATUS(status) != 0) || WIFSIGNALED(status)) {
+            throw std::runtime_error{"SELinux relabelling failed."};
+        }
+    }
 }
 
 void Transaction::impl::addSupplements() {
@@ -278,24 +458,28 @@ void Transaction::impl::addSupplements() {
     supplements.addDir(fs::path{"/var/spool"});
 }
 
-// Callback function for nftw to register all directories for inotify
-int Transaction::impl::inotifyAdd(const char *pathname, const struct stat *sbuf, int type, struct FTW *ftwb) {
-    if (!(type == FTW_D))
-        return 0;
-    std::vector<std::filesystem::path>::iterator it;
-    for (it = inotifyExcludes.begin(); it != inotifyExcludes.end(); it++) {
-        if (std::string(pathname).find(*it) == 0)
-            return 0;
-    }
-    int num;
-    if ((num = inotify_add_watch(inotifyFd, pathname, IN_MODIFY | IN_MOVE | IN_CREATE | IN_DELETE | IN_ATTRIB | IN_ONESHOT | IN_ONLYDIR | IN_DONT_FOLLOW)) == -1)
-        tulog.info("WARNING: Cannot register inotify watch for ", pathname);
-    else
-        tulog.debug("Watching ", pathname, " with descriptor number ", num);
-    return 0;
+// Register all directories of the snapshot's root file system for inotify
+void Transaction::impl::inotifyAdd() {
+    walkTree(snapshot->getRoot(), [this](const FTSENT* entry) {
+        if (entry->fts_info != FTS_D)
+            return true;
+        std::string pathname = entry->fts_path;
+        for (auto& exclude: inotifyExcludes) {
+            if (pathname.find(exclude) == 0)
+                return false;
+        }
+        int num;
+        if ((num = inotify_add_watch(inotifyFd, pathname.c_str(), IN_MODIFY | IN_MOVE | IN_CREATE | IN_DELETE | IN_ATTRIB | IN_ONESHOT | IN_ONLYDIR | IN_DONT_FOLLOW)) == -1)
+            tulog.info("WARNING: Cannot register inotify watch for ", pathname);
+        else
+            tulog.debug("Watching ", pathname, " with descriptor number ", num);
+        return true;
+    });
 }
 
 void Transaction::init(std::string base, std::optional<std::string> description) {
+    TULogScope logScope{&TULogContext::transaction, ""};
+    TimingScope timingScope{pImpl->timings};
     TransactionalUpdate::Plugins plugins{nullptr, pImpl->keepIfError};
     plugins.run("init-pre", nullptr);
 
@@ -306,6 +490,8 @@ void Transaction::init(std::string base, std::optional<std::string> description)
     if (!description)
         description = "Snapshot Update of #" + base;
     pImpl->snapshot = pImpl->snapshotMgr->create(base, description.value());
+    tulogContext.transaction = pImpl->snapshot->getUid();
+    metrics.increment("tukit_transactions_total", {{"event", "opened"}});
 
     tulog.info("Using snapshot " + base + " as base for new snapshot " + pImpl->snapshot->getUid() + ".");
 
@@ -330,6 +516,8 @@ void Transaction::init(std::string base, std::optional<std::string> description)
 }
 
 void Transaction::resume(std::string id) {
+    TULogScope logScope{&TULogContext::transaction, id};
+    TimingScope timingScope{pImpl->timings};
     TransactionalUpdate::Plugins plugins{nullptr, pImpl->keepIfError};
     plugins.run("resume-pre", id);
 
@@ -377,9 +565,12 @@ int Transaction::impl::inotifyRead() {
     return ret;
 }
 
-int Transaction::impl::runCommand(char* argv[], bool inChroot, std::string* output) {
-    if (discardIfNoChange) {
-        inotifyFd = inotify_init();
+int Transaction::impl::runCommand(char* argv[], bool inChroot, const OutputCallback& output) {
+    // Register the watches only once per transaction: events of previous
+    // commands stay queued, and the unfired watches still cover the tree
+    std::unique_lock<std::mutex> inotifyGuard{inotifyLock};
+    if (discardIfNoChange && inotifyFd < 0) {
+        inotifyFd = inotify_init1(IN_CLOEXEC);
         if (inotifyFd == -1)
             throw std::runtime_error{"Couldn't initialize inotify."};
 
@@ -398,8 +589,10 @@ int Transaction::impl::runCommand(char* argv[], bool inChroot, std::string* outp
             if (itr != inotifyExcludes.end()) inotifyExcludes.erase(itr);
         }
 
-        nftw(snapshot->getRoot().c_str(), inotifyAdd, 20, FTW_MOUNT | FTW_PHYS);
+        ScopedTimer inotifyTimer{"inotify-setup"};
+        inotifyAdd();
     }
+    inotifyGuard.unlock();
 
     std::string opts = "Executing `";
     int i = 0;
@@ -412,11 +605,14 @@ int Transaction::impl::runCommand(char* argv[], bool inChroot, std::string* outp
     opts.append("`:");
     tulog.info(opts);
 
+    ScopedTimer timer{"command", argv[0]};
+
     int status = 1;
     int ret;
     int pipefd[2];
 
-    ret = pipe(pipefd);
+    // Commands may run concurrently; none of them may keep the other commands' pipes open
+    ret = pipe2(pipefd, O_CLOEXEC);
     if (ret < 0) {
         throw std::runtime_error{"Error opening pipe for command output: " + std::string(strerror(errno))};
     }
@@ -425,7 +621,7 @@ int Transaction::impl::runCommand(char* argv[], bool inChroot, std::string* outp
     if (pid < 0) {
         throw std::runtime_error{"fork() failed: " + std::string(strerror(errno))};
     } else if (pid == 0) {
-        if (output != nullptr) {
+        if (output) {
             ret = dup2(pipefd[1], STDOUT_FILENO);
             if (ret < 0) {
                 tulog.error("Redirecting stdout failed: " + std::string(strerror(errno)));
@@ -443,8 +639,15 @@ int Transaction::impl::runCommand(char* argv[], bool inChroot, std::string* outp
             }
         }
 
+        // Commands may be started from other threads than the one which set up the mounts
+        auto currentPath = std::filesystem::current_path();
+        if (setns(mountNs, CLONE_NEWNS) < 0) {
+            tulog.error("Entering mount namespace of the transaction failed: " + std::string(strerror(errno)));
+            _exit(errno);
+        }
+
         if (inChroot) {
-            auto currentPathRel = std::filesystem::current_path().relative_path();
+            auto currentPathRel = currentPath.relative_path();
             if (!std::filesystem::exists(bindDir / currentPathRel) || chdir((bindDir / currentPathRel).c_str()) < 0) {
                 if (chdir(bindDir.c_str()) < 0) {
                     tulog.info("Warning: Couldn't set working directory: ", std::string(strerror(errno)));
@@ -463,6 +666,8 @@ int Transaction::impl::runCommand(char* argv[], bool inChroot, std::string* outp
                 tulog.error("Setting private mount for command execution failed: " + std::string(strerror(errno)));
                 _exit(errno);
             }
+        } else if (chdir(currentPath.c_str()) < 0) {
+            tulog.info("Warning: Couldn't set working directory: ", std::string(strerror(errno)));
         }
 
         // Set indicator for RPM pre/post sections to detect whether we run in a
@@ -486,17 +691,25 @@ int Transaction::impl::runCommand(char* argv[], bool inChroot, std::string* outp
         if (ret < 0) {
             throw std::runtime_error{"Closing pipefd failed: " + std::string(strerror(errno))};
         }
-        if (output != nullptr) {
+        // Set before reading the output, so sendSignal() can interrupt the command
+        {
+            std::lock_guard<std::mutex> guard{pidLock};
+            pidsCmd.insert(pid);
+        }
+        if (output) {
             char buffer[2048];
             ssize_t len;
             while((len = read(pipefd[0], buffer, 2048)) > 0) {
-                output->append(buffer, len);
+                output(buffer, len);
             }
         }
+        close(pipefd[0]);
 
-        this->pidCmd = pid;
         ret = waitpid(pid, &status, 0);
-        this->pidCmd = 0;
+        {
+            std::lock_guard<std::mutex> guard{pidLock};
+            pidsCmd.erase(pid);
+        }
         if (ret < 0) {
             throw std::runtime_error{"waitpid() failed: " + std::string(strerror(errno))};
         } else {
@@ -513,15 +726,40 @@ int Transaction::impl::runCommand(char* argv[], bool inChroot, std::string* outp
     return ret;
 }
 
+// Output callback appending to the given string; won't redirect the output if unset
+static OutputCallback collectOutput(std::string* output) {
+    if (output == nullptr)
+        return nullptr;
+    return [output](const char* data, size_t len) { output->append(data, len); };
+}
+
 int Transaction::execute(char* argv[], std::string* output) {
+    return execute(argv, collectOutput(output));
+}
+
+int Transaction::execute(char* argv[], const OutputCallback& outputCallback) {
+    std::shared_lock<std::shared_mutex> commandLock{pImpl->commandLock};
+    if (!pImpl->snapshot)
+        throw std::runtime_error{"Transaction is not open."};
+    TULogScope logScope{&TULogContext::transaction, pImpl->snapshot->getUid()};
+    TimingScope timingScope{pImpl->timings};
     TransactionalUpdate::Plugins plugins{this, pImpl->keepIfError};
     plugins.run("execute-pre", argv);
-    int status = this->pImpl->runCommand(argv, true, output);
+    int status = this->pImpl->runCommand(argv, true, outputCallback);
     plugins.run("execute-post", argv);
     return status;
 }
 
 int Transaction::callExt(char* argv[], std::string* output) {
+    return callExt(argv, collectOutput(output));
+}
+
+int Transaction::callExt(char* argv[], const OutputCallback& outputCallback) {
+    std::shared_lock<std::shared_mutex> commandLock{pImpl->commandLock};
+    if (!pImpl->snapshot)
+        throw std::runtime_error{"Transaction is not open."};
+    TULogScope logScope{&TULogContext::transaction, pImpl->snapshot->getUid()};
+    TimingScope timingScope{pImpl->timings};
     for (int i=0; argv[i] != nullptr; i++) {
         std::string s = std::string(argv[i]);
         std::string from = "{}";
@@ -535,24 +773,55 @@ int Transaction::callExt(char* argv[], std::string* output) {
 
     TransactionalUpdate::Plugins plugins{this, pImpl->keepIfError};
     plugins.run("callExt-pre", argv);
-    int status = this->pImpl->runCommand(argv, false, output);
+    int status = this->pImpl->runCommand(argv, false, outputCallback);
     plugins.run("callExt-post", argv);
     return status;
 }
 
 void Transaction::sendSignal(int signal) {
-    if (pImpl->pidCmd != 0) {
-        if (kill(pImpl->pidCmd, signal) < 0) {
-            throw std::runtime_error{"Could not send signal " + std::to_string(signal) + " to process " + std::to_string(pImpl->pidCmd) + ": " + std::string(strerror(errno))};
+    std::lock_guard<std::mutex> guard{pImpl->pidLock};
+    for (pid_t pid: pImpl->pidsCmd) {
+        if (kill(pid, signal) < 0) {
+            throw std::runtime_error{"Could not send signal " + std::to_string(signal) + " to process " + std::to_string(pid) + ": " + std::string(strerror(errno))};
         }
     }
 }
 
+// Flush the snapshot's file system and the directories bind mounted into it
+// instead of calling sync(), which would also wait for the writeback of all
+// unrelated (and possibly huge) data volumes of the system.
+void Transaction::impl::syncSnapshot() {
+    ScopedTimer timer{"sync"};
+    std::vector<fs::path> paths{snapshot->getRoot()};
+    paths.insert(paths.end(), syncDirs.begin(), syncDirs.end());
+
+    std::unordered_set<dev_t> synced;
+    for (auto& path: paths) {
+        int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error{"Opening '" + path.native() + "' for syncing failed: " + std::string(strerror(errno))};
+        struct stat st;
+        if (fstat(fd, &st) == 0 && !synced.insert(st.st_dev).second) {
+            close(fd);
+            continue;
+        }
+        tulog.debug("Syncing file system of ", path.native());
+        int ret = syncfs(fd);
+        int err = errno;
+        close(fd);
+        if (ret != 0)
+            throw std::runtime_error{"Syncing '" + path.native() + "' failed: " + std::string(strerror(err))};
+    }
+}
+
 void Transaction::impl::closeSnapshot(bool aborted) {
-    sync();
-    if (discardIfNoChange &&
-            ((inotifyFd != 0 && inotifyRead() == 0) ||
-            (inotifyFd == 0 && fs::exists(snapshot->getRoot() / "discardIfNoChange")))) {
+    ScopedTimer timer{"close-snapshot"};
+    bool deferSync = config.get("DEFER_SYNC") == "true";
+    if (!deferSync)
+        syncSnapshot();
+    // keep() removes the flag file as soon as it has seen a change; its events are consumed by then
+    if (discardIfNoChange && fs::exists(snapshot->getRoot() / "discardIfNoChange") &&
+            (inotifyFd < 0 || inotifyRead() == 0)) {
         tulog.info("No changes to the root file system - discarding snapshot.");
 
         // Even if the snapshot itself does not contain any changes, /etc may do so. If the new snapshot is a
@@ -581,6 +850,7 @@ void Transaction::impl::closeSnapshot(bool aborted) {
         TransactionalUpdate::Plugins plugins_without_transaction{nullptr, keepIfError};
         plugins_without_transaction.run("finalize-post", snapshot->getUid() + " " + "discarded");
         snapshot->abort();
+        metrics.increment("tukit_transactions_total", {{"event", "discarded"}});
         return;
     }
     if (fs::exists(snapshot->getRoot() / "discardIfNoChange")) {
@@ -595,7 +865,13 @@ void Transaction::impl::closeSnapshot(bool aborted) {
         snapshot->close();
     }
     supplements.cleanup();
+
+    // With deferred syncing this is the only flush of the whole transaction;
+    // it still has to happen before the snapshot may become the default one.
+    if (deferSync)
+        syncSnapshot();
     dirsToMount.clear();
+    syncDirs.clear();
 
     std::unique_ptr<Snapshot> defaultSnap = snapshotMgr->open(snapshotMgr->getDefault());
     if (defaultSnap->isReadOnly())
@@ -603,10 +879,14 @@ void Transaction::impl::closeSnapshot(bool aborted) {
     if (! aborted) {
         snapshot->setDefault();
         tulog.info("New default snapshot is #" + snapshot->getUid() + " (" + std::string(snapshot->getRoot()) + ").");
+        metrics.increment("tukit_transactions_total", {{"event", "finalized"}});
     }
 }
 
 void Transaction::finalize() {
+    std::unique_lock<std::shared_mutex> commandLock{pImpl->commandLock};
+    TULogScope logScope{&TULogContext::transaction, pImpl->snapshot ? pImpl->snapshot->getUid() : ""};
+    TimingScope timingScope{pImpl->timings};
     TransactionalUpdate::Plugins plugins{this, pImpl->keepIfError};
     plugins.run("finalize-pre", nullptr);
 
@@ -617,14 +897,20 @@ void Transaction::finalize() {
 
     TransactionalUpdate::Plugins plugins_without_transaction{nullptr, pImpl->keepIfError};
     plugins_without_transaction.run("finalize-post", id);
+
+    pImpl->timings.report(id);
 }
 
 void Transaction::keep() {
+    std::unique_lock<std::shared_mutex> commandLock{pImpl->commandLock};
+    TULogScope logScope{&TULogContext::transaction, pImpl->snapshot ? pImpl->snapshot->getUid() : ""};
+    TimingScope timingScope{pImpl->timings};
     TransactionalUpdate::Plugins plugins{this, pImpl->keepIfError};
     plugins.run("keep-pre", nullptr);
 
-    sync();
-    if (fs::exists(pImpl->snapshot->getRoot() / "discardIfNoChange") && (inotifyFd != 0 && pImpl->inotifyRead() > 0)) {
+    if (config.get("DEFER_SYNC") != "true")
+        pImpl->syncSnapshot();
+    if (fs::exists(pImpl->snapshot->getRoot() / "discardIfNoChange") && (pImpl->inotifyFd >= 0 && pImpl->inotifyRead() > 0)) {
         tulog.debug("Snapshot was changed, removing discard flagfile.");
         fs::remove(pImpl->snapshot->getRoot() / "discardIfNoChange");
     }
@@ -634,4 +920,6 @@ void Transaction::keep() {
 
     TransactionalUpdate::Plugins plugins_without_transaction{nullptr, pImpl->keepIfError};
     plugins_without_transaction.run("keep-post", id);
+
+    pImpl->timings.report(id);
 }
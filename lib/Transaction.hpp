@@ -13,10 +13,17 @@
 #define T_U_TRANSACTION_H
 
 #include <filesystem>
+#include <functional>
 #include <optional>
 
 namespace TransactionalUpdate {
 
+/**
+ * Receives a command's output in chunks while the command is still running; @data is not
+ * null terminated.
+ */
+using OutputCallback = std::function<void(const char* data, size_t len)>;
+
 class Transaction {
 public:
     /**
@@ -93,12 +100,33 @@ public:
      * Execute any given command within the new snapshot. The application's output will be
      * printed to the corresponding streams or, if set, stored in the output variable.
      *
+     * execute() and callExt() may be called from several threads at the same time; the
+     * commands will then run in parallel in the same prepared environment. The mounts of
+     * that environment only exist in the mount namespace of the thread which called init()
+     * or resume(): The commands are always started in that namespace, but finalize(), keep()
+     * and the destructor have to be called from a thread in the same namespace, too (e.g.
+     * the same thread, or one which entered it with setns()). They wait for all running
+     * commands to finish.
+     *
      * Note that @param is following the default C style syntax:
      * @example: char *args[] = {(char*)"ls", (char*)"-l", NULL};
                  int status = transaction.execute(args);
      */
     int execute(char* argv[], std::string *output=nullptr);
 
+    /**
+     * @brief Execute the given application in the new snapshot and stream its output
+     * @param argv
+     * @param outputCallback Function to pass the command's output to
+     * @return application's return code
+     *
+     * Same as execute(), but instead of collecting the whole output until the command exits,
+     * stdout and stderr of the command will be passed to @outputCallback as soon as they are
+     * available. This allows to follow the progress of long running commands without keeping
+     * their complete output in memory.
+     */
+    int execute(char* argv[], const OutputCallback& outputCallback);
+
     /**
      * @brief Replace '{}' in argv with mount directory and execute command
      * @param argv
@@ -118,6 +146,17 @@ public:
      */
     int callExt(char* argv[], std::string *output=nullptr);
 
+    /**
+     * @brief Replace '{}' in argv with mount directory, execute command and stream its output
+     * @param argv
+     * @param outputCallback Function to pass the command's output to
+     * @return application's return code
+     *
+     * Same as callExt(), but the command's output will be passed to @outputCallback while the
+     * command is running, see execute().
+     */
+    int callExt(char* argv[], const OutputCallback& outputCallback);
+
     /**
      * @brief Close a transaction and set it as the new default snapshot
      *
@@ -144,7 +183,7 @@ public:
      * @param int Signal number
      *
      * If a transaction is currently running, then the given signal will be sent to the
-     * transaction's process (i.e. the command called by execute()) if started already.
+     * transaction's processes (i.e. the commands called by execute()) if started already.
      */
     void sendSignal(int signal);
 
@@ -175,6 +214,17 @@ public:
      */
     std::filesystem::path getRoot();
 
+    /**
+     * @brief Return the time spent in the individual phases of the transaction
+     * @return JSON object with the measurements
+     *
+     * Phases such as mounting the snapshot, relabelling, plugin calls, snapshot manager calls,
+     * executed commands or closing the snapshot are measured with a monotonic clock. The
+     * timings recorded by this Transaction object are also logged when calling finalize() or
+     * keep().
+     */
+    std::string getTimings();
+
     friend class Plugins;
 protected:
     std::filesystem::path getBindDir();
@@ -12,6 +12,7 @@
 #include <getopt.h>
 #include <grp.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <rpm/rpmcli.h>
 #include <rpm/rpmdb.h>
@@ -40,6 +41,52 @@ static void print_error(void) {
             "Try `create_dirs_from_rpmdb --help' or `create_dirs_from_rpmdb --usage' for more information.\n");
 }
 
+/* Maximum number of threads creating directories */
+#define MAX_THREADS 8
+
+/* The directory names are only freed at the end, so instead of allocating each of them
+   separately they are stored in bigger blocks. */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+static struct arena_block *arena = NULL;
+
+static char *arena_strdup(const char *str) {
+    size_t len = strlen(str) + 1;
+
+    if (arena == NULL || arena->size - arena->used < len) {
+        size_t size = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+        struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+        if (block == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        block->next = arena;
+        block->size = size;
+        block->used = 0;
+        arena = block;
+    }
+
+    char *copy = arena->data + arena->used;
+    memcpy(copy, str, len);
+    arena->used += len;
+    return copy;
+}
+
+static void arena_free(void) {
+    while (arena != NULL) {
+        struct arena_block *next = arena->next;
+        free(arena);
+        arena = next;
+    }
+}
+
 /* Quicksort code to sort the directories before creating them. Else we could run into the case,
    that we have to create sub-directories and the parents don't exist yet. */
 
@@ -54,6 +101,11 @@ struct node {
 struct node *dir_list = NULL;
 size_t dir_list_size = 0, dir_list_capacity = 0;
 
+/* Directories are only created below these prefixes; the file descriptors are used to check
+   for existing directories without resolving the whole path each time. */
+static const char *prefixes[] = {"/var/", "/srv/"};
+static int prefix_fds[] = {-1, -1};
+
 /* A utility function to insert a node at the beginning of linked list */
 void insert_node(const char *dirname, rpm_mode_t fmode,
                  uid_t user_id, gid_t group_id, time_t fmtime) {
@@ -71,15 +123,24 @@ void insert_node(const char *dirname, rpm_mode_t fmode,
     struct node *new_node = &dir_list[dir_list_size - 1];
 
     /* put in the data  */
-    new_node->dirname = strdup(dirname);
+    new_node->dirname = arena_strdup(dirname);
     new_node->fmode = fmode;
     new_node->user_id = user_id;
     new_node->group_id = group_id;
     new_node->fmtime = fmtime;
 }
 
+/* Like strcmp, but '/' sorts before any other character, so a directory is directly followed
+   by all of its subdirectories (e.g. "/var/a", "/var/a/b", "/var/a-b"). */
 int nodecmp(const void *p1, const void *p2) {
-    return strcmp(((const struct node *)p1)->dirname, ((const struct node *)p2)->dirname);
+    const unsigned char *s1 = (const unsigned char *)((const struct node *)p1)->dirname;
+    const unsigned char *s2 = (const unsigned char *)((const struct node *)p2)->dirname;
+
+    while (*s1 != '\0' && *s1 == *s2) {
+        s1++;
+        s2++;
+    }
+    return (*s1 == '/' ? 1 : *s1) - (*s2 == '/' ? 1 : *s2);
 }
 
 static char *
@@ -132,7 +193,194 @@ fmode2str(int mode) {
     return str;
 }
 
-int check_package(rpmts ts, Header h) {
+/* Persistent index of the directories below the prefixes contained in each package, using
+   the package's header SHA1 as key. Only packages which were added or changed since the last
+   run have to be read from the RPM database then.
+
+   Format: a version line, followed by one "P <sha1>" line per package, each followed by
+   one "D <mode> <mtime> <user> <group> <path>" line per directory. */
+#define INDEX_DIR "/var/lib/create-dirs-from-rpmdb"
+#define INDEX_FILE INDEX_DIR "/index"
+#define INDEX_VERSION "create-dirs-from-rpmdb index 1"
+
+struct indexed_dir {
+    const char *dirname;
+    const char *user;
+    const char *group;
+    rpm_mode_t fmode;
+    time_t fmtime;
+};
+
+struct indexed_package {
+    const char *sha1;
+    size_t first_dir;
+    size_t ndirs;
+};
+
+static struct indexed_package *index_packages = NULL;
+static size_t index_npackages = 0;
+static struct indexed_dir *index_dirs = NULL;
+static size_t index_ndirs = 0;
+
+static void *grow_array(void *array, size_t size, size_t elem_size) {
+    /* Grow in powers of two */
+    if (size == 0 || (size & (size - 1)) == 0) {
+        array = realloc(array, (size ? size * 2 : 16) * elem_size);
+        if (array == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    return array;
+}
+
+static int index_package_cmp(const void *p1, const void *p2) {
+    return strcmp(((const struct indexed_package *)p1)->sha1, ((const struct indexed_package *)p2)->sha1);
+}
+
+/* Read the index of the previous run; an invalid index will just be ignored */
+static void index_read(void) {
+    FILE *f = fopen(INDEX_FILE, "r");
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    int valid = 0;
+
+    if (f == NULL)
+        return;
+
+    if ((read = getline(&line, &len, f)) > 0 && strncmp(line, INDEX_VERSION "\n", read) == 0)
+        valid = 1;
+    while (valid && (read = getline(&line, &len, f)) > 0) {
+        if (line[read - 1] == '\n')
+            line[--read] = '\0';
+
+        if (strncmp(line, "P ", 2) == 0) {
+            index_packages = grow_array(index_packages, index_npackages, sizeof(struct indexed_package));
+            struct indexed_package *pkg = &index_packages[index_npackages++];
+            pkg->sha1 = arena_strdup(line + 2);
+            pkg->first_dir = index_ndirs;
+            pkg->ndirs = 0;
+        } else if (strcmp(line, "D invalid") == 0 && index_npackages > 0) {
+            /* Never matches, so the package will be read from the database again */
+            index_packages[index_npackages - 1].sha1 = "-";
+        } else if (strncmp(line, "D ", 2) == 0 && index_npackages > 0) {
+            char user[256], group[256];
+            unsigned int mode;
+            long long mtime;
+            int pos = 0;
+
+            if (sscanf(line, "D %o %lld %255s %255s %n", &mode, &mtime, user, group, &pos) != 4 || pos == 0) {
+                valid = 0;
+                break;
+            }
+            index_dirs = grow_array(index_dirs, index_ndirs, sizeof(struct indexed_dir));
+            struct indexed_dir *dir = &index_dirs[index_ndirs++];
+            dir->dirname = arena_strdup(line + pos);
+            dir->user = arena_strdup(user);
+            dir->group = arena_strdup(group);
+            dir->fmode = mode;
+            dir->fmtime = mtime;
+            index_packages[index_npackages - 1].ndirs++;
+        } else {
+            valid = 0;
+        }
+    }
+    free(line);
+    fclose(f);
+
+    if (!valid) {
+        if (verbose_flag)
+            puts("Ignoring invalid index");
+        index_npackages = 0;
+        index_ndirs = 0;
+        return;
+    }
+    if (index_npackages > 0)
+        qsort(index_packages, index_npackages, sizeof(struct indexed_package), index_package_cmp);
+}
+
+static struct indexed_package *index_find(const char *sha1) {
+    struct indexed_package key = {.sha1 = sha1};
+
+    if (index_npackages == 0)
+        return NULL;
+    return bsearch(&key, index_packages, index_npackages, sizeof(struct indexed_package), index_package_cmp);
+}
+
+static void index_write_dir(FILE *index_file, const char *fn, rpm_mode_t fmode, const char *fuser,
+                            const char *fgroup, time_t mtime) {
+    /* Such names can't be stored; the package will just be read again next time */
+    if (strchr(fn, '\n') != NULL || strchr(fuser, ' ') != NULL || strchr(fgroup, ' ') != NULL) {
+        fprintf(index_file, "D invalid\n");
+        return;
+    }
+    fprintf(index_file, "D %o %lld %s %s %s\n", (unsigned int)fmode, (long long)mtime, fuser, fgroup, fn);
+}
+
+/* Add dir to the list of directories to create if it doesn't exist yet */
+static int add_missing_dir(const char *fn, rpm_mode_t fmode, const char *fuser,
+                           const char *fgroup, time_t mtime) {
+    size_t i;
+    struct stat st;
+
+    for (i = 0; i < sizeof(prefixes) / sizeof(char *); i++) {
+        size_t prefix_len = strlen(prefixes[i]);
+        if (strncmp(prefixes[i], fn, prefix_len) == 0 &&
+            (prefix_fds[i] < 0 || fstatat(prefix_fds[i], fn + prefix_len, &st, 0) == -1)) {
+            struct tm *tm;
+            char timefield[100];
+            uid_t user_id;
+            gid_t group_id;
+            struct passwd *pwd;
+            struct group *grp;
+
+            if (debug_flag) {
+                char *perms = fmode2str(fmode);
+
+                /* Convert file mtime to display format */
+                tm = localtime(&mtime);
+                timefield[0] = '\0';
+                if (tm != NULL) {
+                    const char *fmt = "%F,%H:%M";
+                    (void)strftime(timefield, sizeof(timefield) - 1, fmt, tm);
+                }
+
+                printf("Missing %s (%s,%s,%s,%s)\n", fn, perms, fuser,
+                       fgroup, timefield);
+                free(perms);
+            }
+
+            pwd = getpwnam(fuser);
+            grp = getgrnam(fgroup);
+
+            if (pwd == NULL || grp == NULL) {
+                fprintf(stderr, "Failed to resolve %s/%s\n",
+                        fuser, fgroup);
+                return 1;
+            }
+
+            user_id = pwd->pw_uid;
+            group_id = grp->gr_gid;
+
+            insert_node(fn, fmode, user_id, group_id, mtime);
+        }
+    }
+    return 0;
+}
+
+static int has_prefix(const char *fn) {
+    size_t i;
+
+    for (i = 0; i < sizeof(prefixes) / sizeof(char *); i++) {
+        if (strncmp(prefixes[i], fn, strlen(prefixes[i])) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Check all directories of a package; if index_file is not NULL, they are recorded there, too */
+int check_package(rpmts ts, Header h, FILE *index_file) {
     int ec = 0;
     rpmfi fi = NULL;
     rpmfiFlags fiflags = (RPMFI_NOHEADER | RPMFI_FLAGS_QUERY);
@@ -146,57 +394,19 @@ int check_package(rpmts ts, Header h) {
         rpm_mode_t fmode = rpmfiFMode(fi);
 
         if (S_ISDIR(fmode)) {
-            const char *prefixes[] = {"/var/", "/srv/"};
             const char *fn = rpmfiFN(fi);
             rpmfileAttrs fflags = rpmfiFFlags(fi);
-            size_t i;
-
-            for (i = 0; i < sizeof(prefixes) / sizeof(char *); i++) {
-                if (!(fflags & RPMFILE_GHOST) &&
-                    strncmp(prefixes[i], fn, strlen(prefixes[i])) == 0 &&
-                    access(fn, F_OK) == -1) {
-                    struct tm *tm;
-                    char timefield[100];
-                    rpm_time_t fmtime = rpmfiFMtime(fi);
-                    time_t mtime = fmtime; /* important if sizeof(int32_t) ! sizeof(time_t) */
-                    const char *fuser = rpmfiFUser(fi);
-                    const char *fgroup = rpmfiFGroup(fi);
-                    uid_t user_id;
-                    gid_t group_id;
-                    struct passwd *pwd;
-                    struct group *grp;
-
-                    if (debug_flag) {
-                        char *perms = fmode2str(fmode);
-
-                        /* Convert file mtime to display format */
-                        tm = localtime(&mtime);
-                        timefield[0] = '\0';
-                        if (tm != NULL) {
-                            const char *fmt = "%F,%H:%M";
-                            (void)strftime(timefield, sizeof(timefield) - 1, fmt, tm);
-                        }
-
-                        printf("Missing %s (%s,%s,%s,%s)\n", fn, perms, fuser,
-                               fgroup, timefield);
-                        free(perms);
-                    }
-
-                    pwd = getpwnam(fuser);
-                    grp = getgrnam(fgroup);
-
-                    if (pwd == NULL || grp == NULL) {
-                        fprintf(stderr, "Failed to resolve %s/%s\n",
-                                fuser, fgroup);
-                        ec = 1;
-                        goto exit;
-                    }
-
-                    user_id = pwd->pw_uid;
-                    group_id = grp->gr_gid;
-
-                    insert_node(fn, fmode, user_id, group_id, fmtime);
-                }
+
+            if (!(fflags & RPMFILE_GHOST) && has_prefix(fn)) {
+                rpm_time_t fmtime = rpmfiFMtime(fi);
+                time_t mtime = fmtime; /* important if sizeof(int32_t) ! sizeof(time_t) */
+                const char *fuser = rpmfiFUser(fi);
+                const char *fgroup = rpmfiFGroup(fi);
+
+                if (index_file != NULL)
+                    index_write_dir(index_file, fn, fmode, fuser, fgroup, mtime);
+                if ((ec = add_missing_dir(fn, fmode, fuser, fgroup, mtime)) != 0)
+                    goto exit;
             }
         }
     }
@@ -207,22 +417,126 @@ exit:
     return ec;
 }
 
-int create_dirs(struct node *node, size_t size) {
+static int offset_cmp(const void *p1, const void *p2) {
+    unsigned int o1 = *(const unsigned int *)p1, o2 = *(const unsigned int *)p2;
+    return (o1 > o2) - (o1 < o2);
+}
+
+static Header get_header(rpmts ts, unsigned int offset, rpmdbMatchIterator *mi) {
+    *mi = rpmtsInitIterator(ts, RPMDBI_PACKAGES, &offset, sizeof(offset));
+    return *mi ? rpmdbNextIterator(*mi) : NULL;
+}
+
+/* Check all packages, reading only those from the database which aren't in the index.
+   Returns -1 if the database indices can't be used. */
+static int check_packages_indexed(rpmts ts, FILE *index_file) {
+    rpmdb db = rpmtsGetRdb(ts);
+    rpmdbIndexIterator ii;
+    rpmdbMatchIterator mi;
+    const void *key;
+    size_t keylen, cached = 0, read = 0;
+    unsigned int *offsets = NULL;
+    size_t noffsets = 0, i, n;
+    int ec = 0, rc;
+    Header h;
+
+    if (index_file == NULL || db == NULL || (ii = rpmdbIndexIteratorInit(db, RPMDBI_SHA1HEADER)) == NULL)
+        return -1;
+
+    while (rpmdbIndexIteratorNext(ii, &key, &keylen) == 0) {
+        char *sha1 = strndup(key, keylen);
+        struct indexed_package *pkg;
+
+        if (sha1 == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        for (n = 0; n < rpmdbIndexIteratorNumPkgs(ii); n++) {
+            offsets = grow_array(offsets, noffsets, sizeof(unsigned int));
+            offsets[noffsets++] = rpmdbIndexIteratorPkgOffset(ii, n);
+        }
+
+        if ((pkg = index_find(sha1)) != NULL) {
+            cached++;
+            fprintf(index_file, "P %s\n", sha1);
+            for (i = pkg->first_dir; i < pkg->first_dir + pkg->ndirs; i++) {
+                struct indexed_dir *dir = &index_dirs[i];
+                index_write_dir(index_file, dir->dirname, dir->fmode, dir->user, dir->group, dir->fmtime);
+                if ((rc = add_missing_dir(dir->dirname, dir->fmode, dir->user, dir->group, dir->fmtime)) != 0)
+                    ec = rc;
+            }
+        } else if (rpmdbIndexIteratorNumPkgs(ii) > 0) {
+            read++;
+            if ((h = get_header(ts, rpmdbIndexIteratorPkgOffset(ii, 0), &mi)) != NULL) {
+                fprintf(index_file, "P %s\n", sha1);
+                if ((rc = check_package(ts, h, index_file)) != 0)
+                    ec = rc;
+            }
+            rpmdbFreeIterator(mi);
+        }
+        free(sha1);
+    }
+    rpmdbIndexIteratorFree(ii);
+
+    /* Packages without a SHA1 header digest are not part of that index, check them the
+       traditional way. */
+    if ((ii = rpmdbIndexIteratorInit(db, RPMDBI_NAME)) != NULL) {
+        if (noffsets > 0)
+            qsort(offsets, noffsets, sizeof(unsigned int), offset_cmp);
+        while (rpmdbIndexIteratorNext(ii, &key, &keylen) == 0) {
+            for (n = 0; n < rpmdbIndexIteratorNumPkgs(ii); n++) {
+                unsigned int offset = rpmdbIndexIteratorPkgOffset(ii, n);
+                if (noffsets > 0 && bsearch(&offset, offsets, noffsets, sizeof(unsigned int), offset_cmp) != NULL)
+                    continue;
+                read++;
+                if ((h = get_header(ts, offset, &mi)) != NULL && (rc = check_package(ts, h, NULL)) != 0)
+                    ec = rc;
+                rpmdbFreeIterator(mi);
+            }
+        }
+        rpmdbIndexIteratorFree(ii);
+    }
+    free(offsets);
+
+    if (verbose_flag)
+        printf("%zu packages unchanged, %zu packages read from the RPM database\n", cached, read);
+    return ec;
+}
+
+/* Check all packages by iterating over the whole database */
+static int check_packages_full(rpmts ts, FILE *index_file) {
+    rpmdbMatchIterator mi = rpmtsInitIterator(ts, RPMDBI_PACKAGES, NULL, 0);
+    Header h;
+    int ec = 0, rc;
+
+    if (mi == NULL)
+        return 1;
+
+    while ((h = rpmdbNextIterator(mi)) != NULL) {
+        const char *sha1 = index_file ? headerGetString(h, RPMTAG_SHA1HEADER) : NULL;
+
+        /* rpmsqPoll (); */
+        if (sha1 != NULL)
+            fprintf(index_file, "P %s\n", sha1);
+        if ((rc = check_package(ts, h, sha1 ? index_file : NULL)) != 0)
+            ec = rc;
+    }
+    rpmdbFreeIterator(mi);
+
+    return ec;
+}
+
+/* selabel lookups are not guaranteed to be thread safe with all libselinux versions */
+static pthread_mutex_t selabel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Create the directories of one subtree; hnd is NULL if SELinux is disabled */
+int create_dirs(struct node *node, size_t size, struct selabel_handle *hnd) {
     int rc = 0;
     size_t i;
 
     char *newcon = NULL;
     char *curcon = NULL;
-    struct selabel_handle *hnd = NULL;
-    int use_selinux = is_selinux_enabled();
-
-    if (use_selinux) {
-        hnd = selabel_open(SELABEL_CTX_FILE, NULL, 0);
-        if (hnd == NULL) {
-            fprintf(stderr, "Failed to open userspace SELinux labeling interface: %m\n");
-            return 1;
-        }
-    }
+    int use_selinux = (hnd != NULL);
 
     for (i = 0; i < size; ++i, ++node) {
         struct timeval stamps[2] = {
@@ -274,7 +588,10 @@ int create_dirs(struct node *node, size_t size) {
 
         /* set selinux file context */
         if (use_selinux) {
-            if (selabel_lookup_raw(hnd, &newcon, node->dirname, node->fmode) < 0) {
+            pthread_mutex_lock(&selabel_lock);
+            int lookup_rc = selabel_lookup_raw(hnd, &newcon, node->dirname, node->fmode);
+            pthread_mutex_unlock(&selabel_lock);
+            if (lookup_rc < 0) {
                 if (errno == ENOENT) {
                     fprintf(stderr, "Warning: No default context for directory '%s'\n", node->dirname);
                     continue;
@@ -315,12 +632,109 @@ int create_dirs(struct node *node, size_t size) {
         }
     }
 
-    if (use_selinux)
-        selabel_close(hnd);
-
     return rc;
 }
 
+/* Subtrees don't depend on each other, so they can be created in parallel */
+struct subtree {
+    struct node *nodes;
+    size_t size;
+};
+
+struct work_queue {
+    pthread_mutex_t lock;
+    struct subtree *subtrees;
+    size_t count;
+    size_t next;
+    struct selabel_handle *hnd;
+    int rc;
+};
+
+static void *create_dirs_worker(void *arg) {
+    struct work_queue *queue = arg;
+
+    while (1) {
+        struct subtree *subtree = NULL;
+        int rc;
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->next < queue->count)
+            subtree = &queue->subtrees[queue->next++];
+        pthread_mutex_unlock(&queue->lock);
+        if (subtree == NULL)
+            break;
+
+        if ((rc = create_dirs(subtree->nodes, subtree->size, queue->hnd)) != 0) {
+            pthread_mutex_lock(&queue->lock);
+            queue->rc = rc;
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+    return NULL;
+}
+
+/* Split the sorted list into subtrees and create them using a thread pool */
+int create_dirs_parallel(struct node *node, size_t size) {
+    struct work_queue queue = {.lock = PTHREAD_MUTEX_INITIALIZER};
+    pthread_t threads[MAX_THREADS];
+    size_t nthreads, i, start;
+    long cpus;
+
+    if (is_selinux_enabled()) {
+        queue.hnd = selabel_open(SELABEL_CTX_FILE, NULL, 0);
+        if (queue.hnd == NULL) {
+            fprintf(stderr, "Failed to open userspace SELinux labeling interface: %m\n");
+            return 1;
+        }
+    }
+
+    queue.subtrees = malloc(size * sizeof(struct subtree));
+    if (queue.subtrees == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (start = 0; start < size; start = i) {
+        const char *root = node[start].dirname;
+        size_t root_len = strlen(root);
+
+        for (i = start + 1; i < size; i++) {
+            const char *dirname = node[i].dirname;
+            if (strncmp(dirname, root, root_len) != 0 ||
+                (dirname[root_len] != '\0' && dirname[root_len] != '/'))
+                break;
+        }
+        queue.subtrees[queue.count].nodes = &node[start];
+        queue.subtrees[queue.count].size = i - start;
+        queue.count++;
+    }
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = cpus > 0 ? (size_t)cpus : 1;
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+    if (nthreads > queue.count)
+        nthreads = queue.count;
+    if (debug_flag)
+        printf("Creating %zu subtrees with %zu threads\n", queue.count, nthreads);
+
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, create_dirs_worker, &queue) != 0) {
+            fprintf(stderr, "Failed to create thread, continuing with %zu threads\n", i);
+            nthreads = i;
+            break;
+        }
+    }
+    create_dirs_worker(&queue);
+    for (i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    free(queue.subtrees);
+    if (queue.hnd != NULL)
+        selabel_close(queue.hnd);
+
+    return queue.rc;
+}
+
 int rpmCookieUnchanged(const char *rpmdb_cookie) {
     int unchanged = 0;
     size_t size = 0;
@@ -359,7 +773,6 @@ void rpmCookieWrite(const char *rpmdb_cookie) {
 }
 
 int main(int argc, char *argv[]) {
-    Header h;
     rpmts ts = NULL;
     int ec = 0;
     const char *rpmdb_cookie = NULL;
@@ -430,31 +843,48 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
-    rpmdbMatchIterator mi = rpmtsInitIterator(ts, RPMDBI_PACKAGES, NULL, 0);
-    if (mi == NULL)
-        return 1;
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(char *); i++)
+        prefix_fds[i] = open(prefixes[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-    while ((h = rpmdbNextIterator(mi)) != NULL) {
-        int rc;
-        /* rpmsqPoll (); */
-        if ((rc = check_package(ts, h)) != 0)
-            ec = rc;
-    }
+    index_read();
+    mkdir("/var/lib", 0755);
+    mkdir(INDEX_DIR, 0755);
+    FILE *index_file = fopen(INDEX_FILE ".new", "w");
+    if (index_file != NULL)
+        fprintf(index_file, INDEX_VERSION "\n");
+    else if (verbose_flag)
+        printf("Cannot write index: %m\n");
+
+    /* Without a working database index the index file can't be used, but it will still be
+       written for the next run */
+    if (rpmtsOpenDB(ts, O_RDONLY) != 0 || (ec = check_packages_indexed(ts, index_file)) < 0)
+        ec = check_packages_full(ts, index_file);
 
     if (dir_list != NULL) {
         int rc;
         qsort(dir_list, dir_list_size, sizeof(struct node), nodecmp);
-        if ((rc = create_dirs(dir_list, dir_list_size)) != 0)
+        if ((rc = create_dirs_parallel(dir_list, dir_list_size)) != 0)
             ec = rc;
     }
 
-    /* XXX missing: free list */
+    free(dir_list);
+    arena_free();
+    for (size_t i = 0; i < sizeof(prefix_fds) / sizeof(int); i++) {
+        if (prefix_fds[i] >= 0)
+            close(prefix_fds[i]);
+    }
+
+    free(index_packages);
+    free(index_dirs);
 
     /* Can't do anything if this fails anyway. */
+    if (index_file != NULL) {
+        if (fclose(index_file) != 0 || ec != 0 || rename(INDEX_FILE ".new", INDEX_FILE) != 0)
+            unlink(INDEX_FILE ".new");
+    }
     if (ec == 0 && rpmdb_cookie)
         rpmCookieWrite(rpmdb_cookie);
 
-    rpmdbFreeIterator(mi);
     rpmtsFree(ts);
 
     return ec;
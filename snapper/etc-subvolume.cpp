@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  transactional-update-etc-subvolume - /etc subvolume handling for snapper's 50-etc plugin
+
+  Exit codes: 0 on success, 1 on error, 2 if "create" found a parent snapshot
+  still using /etc overlays which has to be migrated first.
+ */
+
+#include "EtcSubvolume.hpp"
+#include "Log.hpp"
+#include <exception>
+#include <iostream>
+#include <string>
+using namespace std;
+using namespace TransactionalUpdate;
+
+static void usage() {
+    cerr << "Usage: transactional-update-etc-subvolume create|delete|parent <snapshot>" << endl;
+    cerr << "       transactional-update-etc-subvolume syncpoint <snapshot> <parent>" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    tulog.level = TULogLevel::Info;
+    if (argc < 3) {
+        usage();
+        return 1;
+    }
+    string command = argv[1];
+    try {
+        EtcSubvolume etc{argv[2]};
+        if (command == "create" && argc == 3) {
+            if (!etc.create())
+                return 2;
+        } else if (command == "delete" && argc == 3) {
+            etc.remove();
+        } else if (command == "parent" && argc == 3) {
+            cout << etc.getParent() << endl;
+        } else if (command == "syncpoint" && argc == 4) {
+            etc.createSyncpoint(argv[3]);
+        } else {
+            usage();
+            return 1;
+        }
+    } catch (const exception &e) {
+        cerr << "ERROR: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,319 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Generator for synthetic /etc trees as input for sync-etc-state: Creates the
+  state at snapshot creation time (syncpoint), the old snapshot's /etc with
+  changes done after the snapshot was created (parent) and the new snapshot's
+  /etc with changes done during the transaction (current). Additionally the
+  expected result of merging parent into current is written (expected), so
+  the generator can be used as a correctness oracle with --verify.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+using namespace std;
+
+// Timestamps of unchanged and changed entries
+static const time_t baseTime = 1600000000;
+static const time_t changeTime = 1700000000;
+
+struct Entry {
+    bool symlink = false;
+    string content; // file content or symlink target
+    mode_t mode = 0644;
+    map<string, string> xattrs;
+    time_t mtime = baseTime;
+};
+
+// Relative path -> entry; a missing path means the entry doesn't exist in that tree
+using Tree = map<string, Entry>;
+
+struct Parameters {
+    unsigned long files = 1000;
+    unsigned long filesPerDir = 20;
+    double xattrDensity = 0.1;
+    double changed = 0.05;
+    double deleted = 0.01;
+    double typeChanged = 0.005;
+    double currentChanged = 0.02;
+    double conflicts = 0.005;
+    unsigned long seed = 1;
+};
+
+class Generator {
+public:
+    Generator(const Parameters& p): p{p}, rng{p.seed} {}
+
+    void generate(Tree& syncpoint, Tree& parent, Tree& current, Tree& expected) {
+        unsigned long dirs = (p.files + p.filesPerDir - 1) / p.filesPerDir;
+        // Two levels of directories, similar to /etc/<package>/<subdir>
+        unsigned long fanout = max(1ul, (unsigned long)sqrt(dirs));
+        for (unsigned long i = 0; i < p.files; i++) {
+            unsigned long dir = i / p.filesPerDir;
+            string path = "pkg" + to_string(dir / fanout) + "/sub" + to_string(dir % fanout) +
+                "/file" + to_string(i) + ".conf";
+            syncpoint[path] = newEntry();
+        }
+        parent = current = expected = syncpoint;
+
+        uniform_real_distribution<double> chance{0, 1};
+        for (auto& [path, entry]: syncpoint) {
+            double r = chance(rng);
+            if ((r -= p.changed) < 0) {
+                // Changed in the running system after the snapshot was created
+                change(parent[path]);
+                expected[path] = parent[path];
+            } else if ((r -= p.deleted) < 0) {
+                parent.erase(path);
+                expected.erase(path);
+            } else if ((r -= p.typeChanged) < 0) {
+                Entry& e = parent[path];
+                e.symlink = !e.symlink;
+                e.content = e.symlink ? "../typechanged" : randomContent();
+                e.xattrs.clear();
+                e.mtime = changeTime;
+                expected[path] = e;
+            } else if ((r -= p.currentChanged) < 0) {
+                // Changed in the new snapshot; will be kept
+                change(current[path]);
+                expected[path] = current[path];
+            } else if ((r -= p.conflicts) < 0) {
+                // Changed in both; the new snapshot wins
+                change(parent[path]);
+                change(current[path]);
+                current[path].content += "current\n";
+                expected[path] = current[path];
+            }
+        }
+
+        // Files added in the running system resp. the new snapshot
+        unsigned long added = p.files * p.changed / 4;
+        for (unsigned long i = 0; i < added; i++) {
+            string path = "pkg0/added/parent" + to_string(i) + ".conf";
+            parent[path] = expected[path] = newEntry(changeTime);
+            path = "pkg0/added/current" + to_string(i) + ".conf";
+            current[path] = expected[path] = newEntry(changeTime);
+        }
+    }
+
+private:
+    Entry newEntry(time_t mtime = baseTime) {
+        Entry e;
+        uniform_real_distribution<double> chance{0, 1};
+        e.symlink = chance(rng) < 0.05;
+        e.content = e.symlink ? "../target" + to_string(rng() % 100) : randomContent();
+        e.mode = chance(rng) < 0.1 ? 0600 : 0644;
+        if (!e.symlink && chance(rng) < p.xattrDensity) {
+            for (unsigned i = 0; i <= rng() % 3; i++)
+                e.xattrs["user.bench" + to_string(i)] = "value" + to_string(rng());
+        }
+        e.mtime = mtime;
+        return e;
+    }
+
+    string randomContent() {
+        // Most configuration files are small
+        size_t size = 64 + rng() % 4096;
+        string content;
+        while (content.size() < size)
+            content += "setting" + to_string(rng() % 1000) + " = " + to_string(rng()) + "\n";
+        return content;
+    }
+
+    void change(Entry& e) {
+        if (e.symlink)
+            e.content += "-changed";
+        else
+            e.content += "changed = " + to_string(rng()) + "\n";
+        if (!e.xattrs.empty())
+            e.xattrs.begin()->second += "-changed";
+        e.mtime = changeTime;
+    }
+
+    const Parameters& p;
+    mt19937_64 rng;
+};
+
+static void setTime(const fs::path& path, time_t mtime) {
+    const struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+    if (utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW) == -1)
+        throw runtime_error{"Setting time of " + path.native() + " failed: " + strerror(errno)};
+}
+
+static void writeTree(const fs::path& root, const Tree& tree) {
+    fs::create_directories(root);
+    for (auto& [relpath, e]: tree) {
+        fs::path path = root / relpath;
+        fs::create_directories(path.parent_path());
+        if (e.symlink) {
+            fs::create_symlink(e.content, path);
+        } else {
+            ofstream out{path, ios::binary};
+            out << e.content;
+            out.close();
+            if (chmod(path.c_str(), e.mode) == -1)
+                throw runtime_error{"chmod of " + path.native() + " failed: " + strerror(errno)};
+            for (auto& [key, value]: e.xattrs) {
+                if (lsetxattr(path.c_str(), key.c_str(), value.data(), value.size(), 0) == -1)
+                    throw runtime_error{"Setting xattr on " + path.native() + " failed: " + strerror(errno)};
+            }
+        }
+        setTime(path, e.mtime);
+    }
+    // Directory timestamps are the same in all trees, only the entries are relevant
+    for (auto& entry: fs::recursive_directory_iterator(root)) {
+        if (entry.is_directory() && !entry.is_symlink())
+            setTime(entry.path(), baseTime);
+    }
+    setTime(root, baseTime);
+}
+
+// Textual description of all non-directory entries, used for comparing trees
+static map<string, string> describe(const fs::path& root) {
+    map<string, string> result;
+    for (auto& entry: fs::recursive_directory_iterator(root)) {
+        struct stat st;
+        if (lstat(entry.path().c_str(), &st) == -1)
+            throw runtime_error{"lstat of " + entry.path().native() + " failed: " + strerror(errno)};
+        if (S_ISDIR(st.st_mode))
+            continue;
+        ostringstream desc;
+        desc << "mode=" << oct << st.st_mode << dec << " mtime=" << st.st_mtim.tv_sec;
+        if (S_ISLNK(st.st_mode)) {
+            desc << " target=" << fs::read_symlink(entry.path()).native();
+        } else {
+            ifstream in{entry.path(), ios::binary};
+            desc << " content=" << hash<string>{}(string{istreambuf_iterator<char>(in), {}});
+            char keys[4096];
+            ssize_t len = llistxattr(entry.path().c_str(), keys, sizeof(keys));
+            map<string, string> xattrs;
+            for (char* key = keys; len > 0 && key < keys + len; key += strlen(key) + 1) {
+                char value[4096];
+                ssize_t vlen = lgetxattr(entry.path().c_str(), key, value, sizeof(value));
+                if (strncmp(key, "user.", 5) == 0 && vlen >= 0)
+                    xattrs[key] = string(value, vlen);
+            }
+            for (auto& [key, value]: xattrs)
+                desc << " " << key << "=" << value;
+        }
+        result[fs::relative(entry.path(), root)] = desc.str();
+    }
+    return result;
+}
+
+static int verify(const fs::path& dir) {
+    auto actual = describe(dir / "current");
+    auto expected = describe(dir / "expected");
+    int differences = 0;
+    for (auto& [path, desc]: expected) {
+        auto it = actual.find(path);
+        if (it == actual.end()) {
+            cout << "Missing: " << path << endl;
+            differences++;
+        } else if (it->second != desc) {
+            cout << "Differs: " << path << "\n  expected: " << desc << "\n  actual:   " << it->second << endl;
+            differences++;
+        }
+    }
+    for (auto& [path, desc]: actual) {
+        if (expected.count(path) == 0) {
+            cout << "Unexpected: " << path << endl;
+            differences++;
+        }
+    }
+    cout << differences << " differences found." << endl;
+    return differences == 0 ? 0 : 1;
+}
+
+static void usage() {
+    cout << "Usage: etc-tree-gen [options] <output directory>\n"
+            "       etc-tree-gen --verify <output directory>\n\n"
+            "Creates the directories parent, current, syncpoint and expected, to be used as\n"
+            "`sync-etc-state <dir>/parent <dir>/current <dir>/syncpoint`. --verify compares the\n"
+            "synced current directory with the expected one afterwards.\n\n"
+            "Options (ratios are given as fraction of all files):\n"
+            "  --files <n>            Number of files (default: 1000)\n"
+            "  --files-per-dir <n>    Files per directory (default: 20)\n"
+            "  --xattrs <ratio>       Files with extended attributes (default: 0.1)\n"
+            "  --changed <ratio>      Files changed in parent (default: 0.05)\n"
+            "  --deleted <ratio>      Files deleted in parent (default: 0.01)\n"
+            "  --type-changed <ratio> Files replaced by symlinks and vice versa in parent (default: 0.005)\n"
+            "  --current-changed <ratio> Files changed in current (default: 0.02)\n"
+            "  --conflicts <ratio>    Files changed in both parent and current (default: 0.005)\n"
+            "  --seed <n>             Random seed (default: 1)\n";
+}
+
+int main(int argc, char *argv[]) {
+    Parameters p;
+    bool doVerify = false;
+
+    static struct option long_options[] = {
+        {"files", required_argument, 0, 'f'},
+        {"files-per-dir", required_argument, 0, 'd'},
+        {"xattrs", required_argument, 0, 'x'},
+        {"changed", required_argument, 0, 'c'},
+        {"deleted", required_argument, 0, 'r'},
+        {"type-changed", required_argument, 0, 't'},
+        {"current-changed", required_argument, 0, 'C'},
+        {"conflicts", required_argument, 0, 'k'},
+        {"seed", required_argument, 0, 's'},
+        {"verify", no_argument, 0, 'v'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int c;
+    try {
+        while ((c = getopt_long(argc, argv, "f:d:x:c:r:t:C:k:s:vh", long_options, nullptr)) != -1) {
+            switch (c) {
+            case 'f': p.files = stoul(optarg); break;
+            case 'd': p.filesPerDir = max(1ul, stoul(optarg)); break;
+            case 'x': p.xattrDensity = stod(optarg); break;
+            case 'c': p.changed = stod(optarg); break;
+            case 'r': p.deleted = stod(optarg); break;
+            case 't': p.typeChanged = stod(optarg); break;
+            case 'C': p.currentChanged = stod(optarg); break;
+            case 'k': p.conflicts = stod(optarg); break;
+            case 's': p.seed = stoul(optarg); break;
+            case 'v': doVerify = true; break;
+            case 'h': usage(); return 0;
+            default: usage(); return 1;
+            }
+        }
+        if (argc - optind != 1) {
+            usage();
+            return 1;
+        }
+        fs::path dir = argv[optind];
+        if (doVerify)
+            return verify(dir);
+
+        if (fs::exists(dir) && !fs::is_empty(dir))
+            throw runtime_error{"Output directory " + dir.native() + " is not empty."};
+        Tree syncpoint, parent, current, expected;
+        Generator{p}.generate(syncpoint, parent, current, expected);
+        writeTree(dir / "syncpoint", syncpoint);
+        writeTree(dir / "parent", parent);
+        writeTree(dir / "current", current);
+        writeTree(dir / "expected", expected);
+    } catch (const exception &e) {
+        cerr << "ERROR: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
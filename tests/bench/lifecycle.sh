@@ -0,0 +1,171 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: Copyright SUSE LLC
+#
+# Benchmark the transaction lifecycle in a loopback btrfs image with a
+# snapper layout (@/.snapshots/<n>/snapshot). The running system's /usr is
+# copied into the image, so tukit, snapper and their dependencies have to be
+# installed. Needs root; all mounts are done in a private mount namespace.
+#
+# Results are printed to stdout as JSON lines, see tukit-bench.
+
+set -euo pipefail
+
+usage() {
+	cat <<-EOT
+	Usage: $0 [options] <tukit-bench binary>
+	  --snapshots <n>        Number of snapshots to create before measuring (default: 20)
+	  --etc-files <n>        Number of synthetic files in /etc (default: 1000)
+	  --usr-size <MiB>       Size of synthetic data in /usr in addition to the host's /usr (default: 0)
+	  --image-size <GiB>     Size of the image file (default: 20)
+	  --iterations <n>       Number of iterations per benchmark (default: 5)
+	  --sync-etc-state <bin> Also measure this sync-etc-state binary
+	  --workdir <dir>        Directory for the image (default: /var/tmp)
+	EOT
+}
+
+snapshots=20
+etc_files=1000
+usr_size=0
+image_size=20
+iterations=5
+sync_etc_state=""
+workdir=/var/tmp
+
+while [ $# -gt 0 ]; do
+	case "$1" in
+		--snapshots) snapshots="$2"; shift;;
+		--etc-files) etc_files="$2"; shift;;
+		--usr-size) usr_size="$2"; shift;;
+		--image-size) image_size="$2"; shift;;
+		--iterations) iterations="$2"; shift;;
+		--sync-etc-state) sync_etc_state="$2"; shift;;
+		--workdir) workdir="$2"; shift;;
+		-h|--help) usage; exit 0;;
+		-*) usage >&2; exit 1;;
+		*) break;;
+	esac
+	shift
+done
+if [ $# -ne 1 ]; then
+	usage >&2
+	exit 1
+fi
+bench="$(realpath "$1")"
+
+if [ "$(id -u)" -ne 0 ]; then
+	echo "ERROR: Benchmarks have to be run as root." >&2
+	exit 1
+fi
+
+# Re-execute in a private mount namespace; mounts will vanish with the process
+if [ -z "${TUKIT_BENCH_UNSHARED:-}" ]; then
+	export TUKIT_BENCH_UNSHARED=1
+	exec unshare --mount --propagation private "$0" --snapshots "${snapshots}" \
+		--etc-files "${etc_files}" --usr-size "${usr_size}" --image-size "${image_size}" \
+		--iterations "${iterations}" ${sync_etc_state:+--sync-etc-state "${sync_etc_state}"} \
+		--workdir "${workdir}" "${bench}"
+fi
+
+tmpdir="$(mktemp --directory "${workdir}/tukit-bench.XXXXXX")"
+image="${tmpdir}/image.btrfs"
+top="${tmpdir}/top"
+root="${tmpdir}/root"
+
+cleanup() {
+	umount --recursive "${root}" 2>/dev/null || true
+	umount "${top}" 2>/dev/null || true
+	if [ -n "${loopdev:-}" ]; then losetup --detach "${loopdev}"; fi
+	rm -rf "${tmpdir}"
+}
+trap cleanup EXIT
+
+log() {
+	echo "# $*" >&2
+}
+
+log "Creating ${image_size} GiB image in ${image}"
+truncate --size "${image_size}G" "${image}"
+mkfs.btrfs --quiet "${image}"
+mkdir "${top}" "${root}"
+loopdev="$(losetup --find --show "${image}")"
+mount -o subvolid=5 "${loopdev}" "${top}"
+
+btrfs --quiet subvolume create "${top}/@"
+btrfs --quiet subvolume create "${top}/@/.snapshots"
+mkdir "${top}/@/.snapshots/1"
+btrfs --quiet subvolume create "${top}/@/.snapshots/1/snapshot"
+cat > "${top}/@/.snapshots/1/info.xml" <<-EOT
+	<?xml version="1.0"?>
+	<snapshot>
+	  <type>single</type>
+	  <num>1</num>
+	  <date>$(date --utc +"%Y-%m-%d %H:%M:%S")</date>
+	  <description>first root filesystem</description>
+	</snapshot>
+EOT
+snap="${top}/@/.snapshots/1/snapshot"
+
+log "Populating root file system"
+cp --archive --reflink=auto /usr "${snap}/usr"
+for dir in bin sbin lib lib64; do
+	[ -L "/${dir}" ] && cp --archive "/${dir}" "${snap}/${dir}"
+done
+cp --archive /etc "${snap}/etc"
+mkdir -p "${snap}"/{proc,sys,dev,run,tmp,var/tmp,var/lib,root,.snapshots}
+: > "${snap}/etc/fstab"
+mkdir -p "${snap}/etc/snapper/configs" "${snap}/etc/sysconfig"
+echo 'SNAPPER_CONFIGS="root"' > "${snap}/etc/sysconfig/snapper"
+cat > "${snap}/etc/snapper/configs/root" <<-EOT
+	SUBVOLUME="/"
+	FSTYPE="btrfs"
+	NUMBER_CLEANUP="no"
+	TIMELINE_CREATE="no"
+EOT
+rm -f "${snap}/etc/tukit.conf"
+
+mkdir "${snap}/etc/tukit-bench"
+for ((i = 0; i < etc_files; i++)); do
+	echo "setting${i}=value${i}" > "${snap}/etc/tukit-bench/file${i}.conf"
+done
+if [ "${usr_size}" -gt 0 ]; then
+	mkdir "${snap}/usr/share/tukit-bench"
+	for ((i = 0; i < usr_size; i++)); do
+		head --bytes=1M /dev/urandom > "${snap}/usr/share/tukit-bench/blob${i}"
+	done
+fi
+
+install -D --mode=755 "${bench}" "${snap}/usr/local/libexec/tukit-bench"
+bench_args=(--iterations "${iterations}")
+if [ -n "${sync_etc_state}" ]; then
+	install -D --mode=755 "${sync_etc_state}" "${snap}/usr/local/libexec/sync-etc-state"
+	trees="${snap}/var/tmp/etc-trees"
+	mkdir -p "${trees}"
+	cp --archive "${snap}/etc" "${trees}/parent"
+	cp --archive "${snap}/etc" "${trees}/syncpoint"
+	cp --archive "${snap}/etc" "${trees}/current"
+	# Some changes in the running system for sync-etc-state to detect
+	for ((i = 0; i < etc_files; i += 10)); do
+		echo "changed" >> "${trees}/current/tukit-bench/file${i}.conf"
+	done
+	bench_args+=(--sync-etc-state /usr/local/libexec/sync-etc-state --etc-trees /var/tmp/etc-trees)
+fi
+
+btrfs subvolume set-default "${snap}"
+umount "${top}"
+
+mount "${loopdev}" "${root}"
+mount -o subvol=@/.snapshots "${loopdev}" "${root}/.snapshots"
+mount -t proc proc "${root}/proc"
+mount --rbind /sys "${root}/sys"
+mount --rbind /dev "${root}/dev"
+mount -t tmpfs tmpfs "${root}/run"
+
+log "Creating ${snapshots} snapshots"
+for ((i = 1; i < snapshots; i++)); do
+	chroot "${root}" snapper --no-dbus create --description "tukit-bench ${i}"
+done
+
+log "Running benchmarks"
+echo "{\"type\":\"parameters\",\"snapshots\":${snapshots},\"etc_files\":${etc_files},\"usr_size_mib\":${usr_size},\"iterations\":${iterations},\"tukit_bench\":\"$(basename "${bench}")\"}"
+chroot "${root}" /usr/local/libexec/tukit-bench "${bench_args[@]}"
@@ -0,0 +1,94 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: Copyright SUSE LLC
+#
+# Benchmark sync-etc-state with synthetic /etc trees created by etc-tree-gen.
+# Each iteration runs on freshly generated trees, first in --dry-run mode, then
+# in real mode; the result of the real run is verified against the expected
+# tree afterwards.
+#
+# Results are printed to stdout as JSON lines: wall time in seconds, peak RSS
+# in KiB (if GNU time is installed) and number of syscalls (if strace is
+# installed; measured in a separate run, as tracing distorts the timing).
+# All other options are passed to etc-tree-gen.
+
+set -euo pipefail
+
+usage() {
+	cat <<-EOT
+	Usage: $0 [--iterations <n>] [--workdir <dir>] [etc-tree-gen options] <etc-tree-gen> <sync-etc-state>
+	EOT
+}
+
+iterations=5
+workdir=/var/tmp
+genargs=()
+
+while [ $# -gt 2 ]; do
+	case "$1" in
+		--iterations) iterations="$2"; shift;;
+		--workdir) workdir="$2"; shift;;
+		-h|--help) usage; exit 0;;
+		--*) genargs+=("$1" "$2"); shift;;
+		*) usage >&2; exit 1;;
+	esac
+	shift
+done
+if [ $# -ne 2 ]; then
+	usage >&2
+	exit 1
+fi
+gen="$(realpath "$1")"
+sync="$(realpath "$2")"
+
+tmpdir="$(mktemp --directory "${workdir}/sync-etc-state-bench.XXXXXX")"
+trap 'rm -rf "${tmpdir}"' EXIT
+
+gnutime=""
+[ -x /usr/bin/time ] && /usr/bin/time --version 2>&1 | grep -q GNU && gnutime=/usr/bin/time
+stracebin="$(command -v strace || true)"
+
+# run <benchmark> <iteration> <sync-etc-state arguments...>
+run() {
+	local benchmark="$1" iteration="$2" start end rss="null" syscalls="null"
+	shift 2
+	if [ -n "${stracebin}" ]; then
+		"${stracebin}" --follow-forks --summary-only --output="${tmpdir}/strace" \
+			"${sync}" "$@" > /dev/null
+		syscalls="$(awk '$NF == "total" { print $4 }' "${tmpdir}/strace")"
+		if [ "${benchmark}" != "dry-run" ]; then
+			# The real run changed the trees, so start from scratch again
+			prepare
+		fi
+	fi
+	start="$(date +%s%N)"
+	if [ -n "${gnutime}" ]; then
+		"${gnutime}" --format=%M --output="${tmpdir}/rss" "${sync}" "$@" > /dev/null
+		rss="$(tail -n 1 "${tmpdir}/rss")"
+	else
+		"${sync}" "$@" > /dev/null
+	fi
+	end="$(date +%s%N)"
+	printf '{"type":"sample","benchmark":"sync-etc-state-%s","iteration":%d,"seconds":%d.%09d,"max_rss_kib":%s,"syscalls":%s}\n' \
+		"${benchmark}" "${iteration}" $(((end - start) / 1000000000)) $(((end - start) % 1000000000)) "${rss}" "${syscalls}"
+}
+
+prepare() {
+	rm -rf "${tmpdir}/trees"
+	"${gen}" "${genargs[@]}" --seed "${seed}" "${tmpdir}/trees"
+}
+
+trees="${tmpdir}/trees"
+sync_args=("${trees}/parent" "${trees}/current" "${trees}/syncpoint")
+echo "{\"type\":\"parameters\",\"iterations\":${iterations},\"generator\":\"${genargs[*]}\"}"
+for ((i = 1; i <= iterations; i++)); do
+	seed="${i}"
+	prepare
+	run dry-run "${i}" --dry-run "${sync_args[@]}"
+	run real "${i}" --keep-syncpoint "${sync_args[@]}"
+	if ! "${gen}" --verify "${trees}" > "${tmpdir}/verify"; then
+		cat "${tmpdir}/verify" >&2
+		echo "ERROR: Result of sync-etc-state differs from the expected tree." >&2
+		exit 1
+	fi
+done
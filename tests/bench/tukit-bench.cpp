@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Benchmark driver for the transaction lifecycle: Measures the individual
+  steps of a transaction on the running system and prints the results as JSON
+  lines. Use lifecycle.sh to run it in a disposable loopback btrfs image.
+ */
+
+#include "Log.hpp"
+#include "SnapshotManager.hpp"
+#include "Transaction.hpp"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace TransactionalUpdate;
+using namespace std;
+
+static map<string, vector<double>> results;
+
+static void measure(const string& benchmark, int iteration, const function<void()>& fn) {
+    auto start = chrono::steady_clock::now();
+    fn();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    results[benchmark].push_back(seconds);
+    cout << "{\"type\":\"sample\",\"benchmark\":\"" << benchmark << "\",\"iteration\":" << iteration
+         << ",\"seconds\":" << seconds << "}" << endl;
+}
+
+static void syncEtcState(const string& binary, const string& trees, bool dryRun) {
+    string parent = trees + "/parent", current = trees + "/current", syncpoint = trees + "/syncpoint";
+    vector<const char*> args = {binary.c_str()};
+    if (dryRun)
+        args.push_back("--dry-run");
+    args.push_back("--keep-syncpoint");
+    args.insert(args.end(), {parent.c_str(), current.c_str(), syncpoint.c_str(), nullptr});
+
+    pid_t pid = fork();
+    if (pid < 0)
+        throw runtime_error{"fork failed"};
+    if (pid == 0) {
+        // The output is not of interest here, but writing it is part of the runtime
+        if (freopen("/dev/null", "w", stdout) == nullptr)
+            _exit(127);
+        execv(args[0], const_cast<char* const*>(args.data()));
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw runtime_error{"sync-etc-state failed with status " + to_string(status)};
+}
+
+static void printSummary() {
+    for (auto& [benchmark, samples]: results) {
+        sort(samples.begin(), samples.end());
+        double sum = 0;
+        for (double s: samples)
+            sum += s;
+        cout << "{\"type\":\"summary\",\"benchmark\":\"" << benchmark << "\",\"runs\":" << samples.size()
+             << ",\"min\":" << samples.front() << ",\"median\":" << samples[samples.size() / 2]
+             << ",\"mean\":" << sum / samples.size() << ",\"max\":" << samples.back() << "}" << endl;
+    }
+}
+
+static void usage() {
+    cerr << "Usage: tukit-bench [--iterations <n>] [--sync-etc-state <binary> --etc-trees <dir>]\n"
+            "The directory given with --etc-trees must contain the subdirectories parent, current\n"
+            "and syncpoint." << endl;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 5;
+    string syncBinary, etcTrees;
+
+    static struct option long_options[] = {
+        {"iterations", required_argument, 0, 'i'},
+        {"sync-etc-state", required_argument, 0, 's'},
+        {"etc-trees", required_argument, 0, 'e'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "i:s:e:h", long_options, nullptr)) != -1) {
+        switch (c) {
+        case 'i':
+            iterations = stoi(optarg);
+            break;
+        case 's':
+            syncBinary = optarg;
+            break;
+        case 'e':
+            etcTrees = optarg;
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (iterations < 1 || syncBinary.empty() != etcTrees.empty()) {
+        usage();
+        return 1;
+    }
+
+    tulog.level = TULogLevel::Error;
+    try {
+        for (int i = 1; i <= iterations; i++) {
+            {
+                Transaction transaction{};
+                measure("init", i, [&] { transaction.init("active"); });
+                char* noop[] = {const_cast<char*>("true"), nullptr};
+                measure("execute-noop", i, [&] {
+                    if (transaction.execute(noop) != 0)
+                        throw runtime_error{"Executing no-op command failed."};
+                });
+                measure("finalize", i, [&] { transaction.finalize(); });
+            }
+            {
+                Transaction transaction{};
+                transaction.setDiscardIfUnchanged(true);
+                transaction.init("active");
+                measure("discard-unchanged", i, [&] { transaction.finalize(); });
+            }
+            measure("getlist", i, [] { SnapshotFactory::get()->getList(""); });
+            if (!syncBinary.empty()) {
+                measure("sync-etc-state-dry-run", i, [&] { syncEtcState(syncBinary, etcTrees, true); });
+            }
+        }
+    } catch (const exception &e) {
+        cerr << "ERROR: " << e.what() << endl;
+        printSummary();
+        return 1;
+    }
+    printSummary();
+    return 0;
+}
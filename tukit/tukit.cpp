@@ -11,6 +11,8 @@
 #include "Transaction.hpp"
 #include "Reboot.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
+#include <algorithm>
 #include <fcntl.h>
 #include <getopt.h>
 #include <unistd.h>
@@ -61,6 +63,11 @@ void TUKit::displayHelp() {
     cout << "Snapshot Commands:\n";
     cout << "snapshots\n";
     cout << "\tPrints a list of all available transactions\n";
+    cout << "cleanup [--previous=<IDs>] [--unused=<IDs>] [--important]\n";
+    cout << "\tMarks the given previously used and unused snapshots as well as snapshots of\n";
+    cout << "\taborted transactions for deletion, except for snapshots which are still in\n";
+    cout << "\tuse; --important additionally marks the previous snapshots as important.\n";
+    cout << "\tPrints the lists of snapshots to pass again on the next cleanup.\n";
     cout << "\n";
     cout << "Snapshot Options:\n"; //TODO: Migrate to options of command
     cout << "--fields=<default,active,number,date,description>, -f<...>\n";
@@ -267,6 +274,44 @@ int TUKit::processCommand(char *argv[]) {
         }
         return 0;
     }
+    else if (arg == "cleanup") {
+        TransactionalUpdate::CleanupState state;
+        bool important = false;
+        auto parseIds = [](string ids) {
+            vector<string> list;
+            replace(ids.begin(), ids.end(), ',', ' ');
+            stringstream idStream(ids);
+            for (string id; idStream >> id; ) {
+                list.push_back(id);
+            }
+            return list;
+        };
+        for (int i = 1; argv[i] != nullptr; i++) {
+            string opt = argv[i];
+            if (opt.rfind("--previous=", 0) == 0) {
+                state.previous = parseIds(opt.substr(strlen("--previous=")));
+            } else if (opt.rfind("--unused=", 0) == 0) {
+                state.unused = parseIds(opt.substr(strlen("--unused=")));
+            } else if (opt == "--important") {
+                important = true;
+            } else {
+                displayHelp();
+                throw invalid_argument{"Unknown option '" + opt + "' for 'cleanup'"};
+            }
+        }
+        unique_ptr<TransactionalUpdate::SnapshotManager> snapshotMgr = TransactionalUpdate::SnapshotFactory::get();
+        auto remaining = snapshotMgr->cleanup(state, important);
+        cout << "previous:";
+        for (auto& id: remaining.previous) {
+            cout << " " << id;
+        }
+        cout << endl << "unused:";
+        for (auto& id: remaining.unused) {
+            cout << " " << id;
+        }
+        cout << endl;
+        return 0;
+    }
     else if (arg == "reboot") {
         string method;
         if (argv[1]) {
@@ -306,6 +351,21 @@ private:
     int lockfile;
 };
 
+// Exports the metrics collected during this call, also if the command failed
+class MetricsExport {
+public:
+    ~MetricsExport() {
+        string path = config.get("METRICS_FILE");
+        if (path.empty())
+            return;
+        try {
+            TransactionalUpdate::metrics.writeTextfile(path);
+        } catch (const exception &e) {
+            tulog.error("ERROR: Could not write metrics: ", e.what());
+        }
+    }
+};
+
 void interrupt(int signal) {
     //Nothing to do here - the child has been signalled already as it's part of the same
     // progress group. Maybe it may be worth killing the process when receiving multiple
@@ -327,6 +387,7 @@ TUKit::TUKit(int argc, char *argv[]) {
     }
 
     Lock lock;
+    MetricsExport metricsExport;
     tulog.info("tukit ", VERSION, " started");
 
     string optionsline = "Options: ";